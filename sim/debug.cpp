@@ -0,0 +1,79 @@
+/**
+ * @file      debug.cpp
+ * @brief     Host debug output for the scheduler simulator
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Stands in for the UART debug output. Output is only printed if the simulator is verbose, but
+ * warnings from the scheduler are always counted.
+ */
+
+#include "util/debug.hpp"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "sim.hpp"
+
+namespace {
+
+/// Print the debug output
+bool verbose = false;
+
+/// Number of "WARNING" lines printed
+unsigned warnings = 0;
+
+}  // namespace
+
+void debug::init(void)
+{
+}
+
+void debug::printf(const char *fs, ...)
+{
+    if (std::strncmp(fs, "WARNING", 7) == 0) {
+        warnings++;
+    }
+
+    if (verbose) {
+        va_list arg;
+        va_start(arg, fs);
+        std::vprintf(fs, arg);
+        va_end(arg);
+    }
+}
+
+void debug::puts(const char *s)
+{
+    if (verbose) {
+        std::fputs(s, stdout);
+    }
+}
+
+void debug::putchar(char c)
+{
+    if (verbose) {
+        std::putchar(c);
+    }
+}
+
+/// An assert is always printed, and ends the simulation
+void debug::assert_failed(char *file, int line, char *expr)
+{
+    std::printf("ERROR: ASSERTION FAILED! %s (%s:%d)\n", expr, file, line);
+    std::exit(EXIT_FAILURE);
+}
+
+void sim::set_verbose(bool on)
+{
+    verbose = on;
+}
+
+unsigned sim::debug_warnings(void)
+{
+    return warnings;
+}
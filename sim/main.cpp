@@ -0,0 +1,304 @@
+/**
+ * @file      main.cpp
+ * @brief     Scheduler simulator entry, synthetic tasks, and the jitter report
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Runs the real timeslice scheduler against synthetic tasks in virtual time, so scheduling changes
+ * can be measured on the host rather than with a logic analyzer. Each synthetic task stands in for
+ * one of the QAZ 65% tasks, and spends a set cost (plus uniform random jitter) of virtual time per
+ * call. Once the simulation ends, the release latency and period jitter of each task is reported,
+ * along with what the scheduler itself counted.
+ *
+ * Usage: qaz_sim [-d seconds] [-s seed] [-v] [task=period_ms:cost_us[:jitter_us]]...
+ *     -d  virtual seconds to simulate (default 10)
+ *     -s  random seed for the task cost jitter (default 1)
+ *     -v  print the firmware's debug output
+ *     task=...  override a task's period and cost. a period of 0 leaves the task unregistered
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "bsp/bsp.hpp"
+#include "core/time_slice.hpp"
+#include "sim.hpp"
+
+namespace {
+
+/// Macro expand an index for each task in the simulator task table
+enum SimTaskId : unsigned {
+#define TASK(module, prio, budget_us) SIM_##module,
+    TASK_TABLE(TASK)
+#undef TASK
+    NUM_SIM_TASKS,
+};
+
+/// Default virtual time to simulate, in seconds
+constexpr unsigned DEFAULT_SECONDS = 10;
+
+/// A synthetic task, and what was measured of it
+struct SimTask {
+    const char *name;
+    void (*func)(void);
+    unsigned period_ms;
+    unsigned cost_us;
+    unsigned jitter_us;
+
+    // measurement state
+    bool started;
+    uint64_t release_ms;
+    uint64_t last_start;
+    std::vector<uint64_t> latencies;
+    std::vector<int64_t> interval_errs;
+};
+
+void run_task(unsigned idx);
+
+}  // namespace
+
+/// Macro expand a synthetic task function for each task in the simulator task table
+#define TASK(module, prio, budget_us) \
+    namespace module { void task(void); }
+TASK_TABLE(TASK)
+#undef TASK
+
+namespace {
+
+/// Synthetic tasks, in task table order. defaults roughly match the QAZ 65% tasks
+SimTask tasks[] = {
+    { "heartbeat", heartbeat::task, 500, 20,   0,   false, 0, 0, {}, {} },
+    { "keymatrix", keymatrix::task, 1,   170,  20,  false, 0, 0, {}, {} },
+    { "lighting",  lighting::task,  5,   1700, 200, false, 0, 0, {}, {} },
+    { "kb_hid",    kb_hid::task,    20,  100,  0,   false, 0, 0, {}, {} },
+};
+
+static_assert(sizeof(tasks)/sizeof(tasks[0]) == NUM_SIM_TASKS, "A synthetic task per table entry");
+
+/// Virtual time simulated, in seconds
+unsigned sim_seconds = DEFAULT_SECONDS;
+
+/// Source of task cost jitter
+std::mt19937 rng(1);
+
+/**
+ * @brief Runs a synthetic task call
+ *
+ * The release this call belongs to is tracked the same way the scheduler does: one period after
+ * the last, unless the task overran it, in which case it is resynced to the end of the call.
+ *
+ * @param[in] idx  index of the synthetic task
+ */
+void run_task(unsigned idx)
+{
+    SimTask &task = tasks[idx];
+    uint64_t start = sim::now();
+
+    if (!task.started) {
+        task.started    = true;
+        task.release_ms = start/sim::CYCLES_PER_MS;
+    } else {
+        task.interval_errs.push_back(static_cast<int64_t>(start - task.last_start) -
+                static_cast<int64_t>(task.period_ms*sim::CYCLES_PER_MS));
+    }
+    task.last_start = start;
+    task.latencies.push_back(start - task.release_ms*sim::CYCLES_PER_MS);
+
+    unsigned cost_us = task.cost_us;
+    if (task.jitter_us != 0) {
+        std::uniform_int_distribution<int> jitter(-static_cast<int>(task.jitter_us),
+                static_cast<int>(task.jitter_us));
+        cost_us = static_cast<unsigned>(std::max(0, static_cast<int>(cost_us) + jitter(rng)));
+    }
+    sim::advance(cost_us*sim::CYCLES_PER_US);
+
+    uint64_t end_ms = sim::now()/sim::CYCLES_PER_MS;
+    task.release_ms += task.period_ms;
+    if (task.release_ms <= end_ms) {
+        task.release_ms = end_ms + task.period_ms;
+    }
+}
+
+/**
+ * @brief Converts clock cycles to microseconds
+ *
+ * @param[in] cycles  clock cycles
+ *
+ * @return microseconds, as a double for printing
+ */
+double to_us(double cycles)
+{
+    return cycles/sim::CYCLES_PER_US;
+}
+
+/**
+ * @brief Prints the report, then ends the simulation
+ *
+ * Called by the virtual time core once the simulated time is up, from wherever the firmware is.
+ */
+void report(void)
+{
+    std::printf("\n==== %us simulated ====\n", sim_seconds);
+    std::printf("%-10s %6s %24s %30s %14s\n", "", "", "release latency (us)",
+            "period error (us)", "");
+    std::printf("%-10s %6s %8s %8s %8s %10s %10s %10s %6s %6s\n", "task", "calls", "mean", "p99",
+            "max", "mean", "max", "stddev", "budget", "missed");
+
+    for (unsigned i = 0; i < NUM_SIM_TASKS; ++i) {
+        SimTask &task = tasks[i];
+        timeslice::TaskStats stats;
+        if (timeslice::get_task_stats(task.func, stats) != timeslice::SUCCESS) {
+            continue;
+        }
+
+        std::vector<uint64_t> &lat = task.latencies;
+        double lat_mean = 0.0;
+        uint64_t lat_p99 = 0;
+        uint64_t lat_max = 0;
+        if (!lat.empty()) {
+            for (uint64_t x : lat) {
+                lat_mean += static_cast<double>(x);
+            }
+            lat_mean /= static_cast<double>(lat.size());
+            std::sort(lat.begin(), lat.end());
+            lat_p99 = lat[(lat.size()*99)/100];
+            lat_max = lat.back();
+        }
+
+        std::vector<int64_t> &err = task.interval_errs;
+        double err_mean = 0.0;
+        double err_var  = 0.0;
+        int64_t err_max = 0;
+        if (!err.empty()) {
+            for (int64_t x : err) {
+                err_mean += static_cast<double>(x);
+                err_max = std::max(err_max, static_cast<int64_t>(std::llabs(x)));
+            }
+            err_mean /= static_cast<double>(err.size());
+            for (int64_t x : err) {
+                err_var += (static_cast<double>(x) - err_mean)*(static_cast<double>(x) - err_mean);
+            }
+            err_var /= static_cast<double>(err.size());
+        }
+
+        std::printf("%-10s %6zu %8.1f %8.1f %8.1f %10.1f %10.1f %10.1f %6u %6u\n", task.name,
+                lat.size(), to_us(lat_mean), to_us(static_cast<double>(lat_p99)),
+                to_us(static_cast<double>(lat_max)), to_us(err_mean),
+                to_us(static_cast<double>(err_max)), to_us(std::sqrt(err_var)),
+                stats.budget_misses, stats.deadline_misses);
+    }
+
+    sim::WatchdogStats wdt = sim::watchdog_stats();
+    double load = 1.0 - (static_cast<double>(sim::sleep_cycles())/static_cast<double>(sim::now()));
+
+    std::printf("\nCPU load:               %.1f%%\n", load*100.0);
+    std::printf("Watchdog windows missed: %u\n", timeslice::get_missed_windows());
+    std::printf("Watchdog refreshes:      %u (longest gap %.1fms, would-be resets %u)\n",
+            wdt.refreshes, to_us(static_cast<double>(wdt.max_gap_cycles))/1000.0, wdt.resets);
+    std::printf("Firmware warnings:       %u\n", sim::debug_warnings());
+
+    std::exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Parses a task override, of the form `name=period_ms:cost_us[:jitter_us]`
+ *
+ * @param[in] arg  command line argument
+ *
+ * @return true if the argument was a valid override for a known task
+ */
+bool parse_task(const char *arg)
+{
+    const char *eq = std::strchr(arg, '=');
+    if (eq == nullptr) {
+        return false;
+    }
+
+    for (unsigned i = 0; i < NUM_SIM_TASKS; ++i) {
+        SimTask &task = tasks[i];
+        size_t len = static_cast<size_t>(eq - arg);
+        if ((std::strlen(task.name) != len) || (std::strncmp(task.name, arg, len) != 0)) {
+            continue;
+        }
+
+        unsigned period, cost, jitter = 0;
+        int n = std::sscanf(eq + 1, "%u:%u:%u", &period, &cost, &jitter);
+        if (n < 2) {
+            return false;
+        }
+
+        task.period_ms = period;
+        task.cost_us   = cost;
+        task.jitter_us = jitter;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Prints the usage
+ *
+ * @param[in] prog  program name
+ */
+void usage(const char *prog)
+{
+    std::printf("Usage: %s [-d seconds] [-s seed] [-v] [task=period_ms:cost_us[:jitter_us]]...\n",
+            prog);
+    std::printf("Tasks:");
+    for (unsigned i = 0; i < NUM_SIM_TASKS; ++i) {
+        std::printf(" %s", tasks[i].name);
+    }
+    std::printf("\n");
+}
+
+}  // namespace
+
+/// Macro expand each synthetic task function, running its entry in the synthetic task list
+#define TASK(module, prio, budget_us) \
+    void module::task(void) { run_task(SIM_##module); }
+TASK_TABLE(TASK)
+#undef TASK
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if ((std::strcmp(argv[i], "-d") == 0) && ((i + 1) < argc)) {
+            sim_seconds = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        } else if ((std::strcmp(argv[i], "-s") == 0) && ((i + 1) < argc)) {
+            rng.seed(static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10)));
+        } else if (std::strcmp(argv[i], "-v") == 0) {
+            sim::set_verbose(true);
+        } else if (!parse_task(argv[i])) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::printf("Simulating %us:", sim_seconds);
+    for (unsigned i = 0; i < NUM_SIM_TASKS; ++i) {
+        std::printf(" %s=%u:%u:%u", tasks[i].name, tasks[i].period_ms, tasks[i].cost_us,
+                tasks[i].jitter_us);
+    }
+    std::printf("\n");
+
+    timeslice::init();
+    for (unsigned i = 0; i < NUM_SIM_TASKS; ++i) {
+        if (tasks[i].period_ms != 0) {
+            timeslice::register_task(tasks[i].period_ms, tasks[i].func);
+        }
+    }
+
+    sim::set_end(sim_seconds*1000, report);
+    timeslice::enter_loop();
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,27 @@
+/**
+ * @file      bsp.hpp
+ * @brief     Simulator BSP, holding the synthetic task table
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Stands in for the board BSP headers, so the scheduler is built with a task table of synthetic
+ * tasks. They mirror the QAZ 65% tasks, but their periods and costs are set at runtime (see
+ * sim/main.cpp).
+ */
+
+#ifndef MOCK_BSP_BSP_HPP_
+#define MOCK_BSP_BSP_HPP_
+
+/// Tasks ran by the timeslice scheduler, in the order they are ran when due at the same time
+///     module    - namespace of the module. its task function must be `module::task`
+///     prio      - priority class (see timeslice::Priority). HIGH tasks preempt LOW tasks
+///     budget_us - longest a single task call should take, in microseconds
+#define TASK_TABLE(TASK) \
+    TASK(heartbeat, LOW,  100)  \
+    TASK(keymatrix, HIGH, 1000) \
+    TASK(lighting,  LOW,  5000) \
+    TASK(kb_hid,    HIGH, 200)
+
+#endif  // MOCK_BSP_BSP_HPP_
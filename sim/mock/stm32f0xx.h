@@ -0,0 +1,108 @@
+/**
+ * @file      stm32f0xx.h
+ * @brief     Host mock of the CMSIS device header, for the scheduler simulator
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Only what the timeslice scheduler (and the event queue) touch is mocked. Registers whose reads
+ * or writes have side effects (SysTick VAL, SCB ICSR, IWDG KR) are proxy objects, so that the
+ * simulator can hook them into its virtual time. Everything else is plain memory.
+ */
+
+#ifndef MOCK_STM32F0XX_H_
+#define MOCK_STM32F0XX_H_
+
+#include <cstdint>
+
+#define __WEAK               __attribute__((weak))
+#define __PACKED             __attribute__((packed))
+#define __COMPILER_BARRIER() __asm volatile("" ::: "memory")
+
+/// Only the system exceptions used by the scheduler
+typedef enum {
+    PendSV_IRQn  = -2,
+    SysTick_IRQn = -1,
+} IRQn_Type;
+
+namespace sim {
+
+/// SysTick current value, counts down through each virtual millisecond
+struct SysTickVal {
+    operator uint32_t() const;
+};
+
+/// SCB interrupt control and state, only PENDSVSET (write) and PENDSTSET (read) are modeled
+struct IcsrReg {
+    operator uint32_t() const;
+    IcsrReg &operator=(uint32_t val);
+};
+
+/// IWDG key register, used to track watchdog refreshes
+struct IwdgKr {
+    IwdgKr &operator=(uint32_t val);
+};
+
+}  // namespace sim
+
+typedef struct {
+    sim::SysTickVal VAL;
+} SysTick_Type;
+
+typedef struct {
+    sim::IcsrReg ICSR;
+    volatile uint32_t SCR;
+} SCB_Type;
+
+typedef struct {
+    sim::IwdgKr KR;
+    volatile uint32_t PR;
+    volatile uint32_t RLR;
+    volatile uint32_t SR;
+} IWDG_TypeDef;
+
+typedef struct {
+    volatile uint32_t APB1FZ;
+} DBGMCU_TypeDef;
+
+typedef struct {
+    volatile uint32_t APB1ENR;
+    volatile uint32_t APB2ENR;
+} RCC_TypeDef;
+
+extern SysTick_Type   sim_systick;
+extern SCB_Type       sim_scb;
+extern IWDG_TypeDef   sim_iwdg;
+extern DBGMCU_TypeDef sim_dbgmcu;
+extern RCC_TypeDef    sim_rcc;
+
+#define SysTick (&sim_systick)
+#define SCB     (&sim_scb)
+#define IWDG    (&sim_iwdg)
+#define DBGMCU  (&sim_dbgmcu)
+#define RCC     (&sim_rcc)
+
+#define SCB_SCR_SLEEPONEXIT_Msk      (1UL << 1)
+#define SCB_ICSR_PENDSTSET_Msk       (1UL << 26)
+#define SCB_ICSR_PENDSVSET_Msk       (1UL << 28)
+#define IWDG_PR_PR_2                 (0x4UL)
+#define RCC_APB2ENR_DBGMCUEN         (1UL << 22)
+#define DBGMCU_APB1_FZ_DBG_IWDG_STOP (1UL << 12)
+
+/// Mask interrupts, they stay pending until unmasked
+void __disable_irq(void);
+
+/// Unmask interrupts, any pending ones are taken right away
+void __enable_irq(void);
+
+/// Sleep until the next interrupt
+void __WFI(void);
+
+/// Start the virtual SysTick, always at 1ms
+uint32_t SysTick_Config(uint32_t ticks);
+
+/// Exception priorities are fixed by the simulator (SysTick above PendSV)
+inline void NVIC_SetPriority(IRQn_Type, uint32_t) {}
+
+#endif  // MOCK_STM32F0XX_H_
@@ -0,0 +1,287 @@
+/**
+ * @file      sim.cpp
+ * @brief     Virtual time core of the scheduler simulator
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Models the parts of the Cortex-M0 the scheduler relies on: the SysTick, PRIMASK, the pending
+ * SysTick/PendSV exceptions and their priorities, WFI, SLEEPONEXIT, and the IWDG refreshes.
+ */
+
+#include "sim.hpp"
+
+#include <cstdint>
+
+#include "core/clock.hpp"
+#include "stm32f0xx.h"  // NOLINT
+
+extern "C" void SysTick_Handler(void);
+extern "C" void PendSV_Handler(void);
+
+SysTick_Type   sim_systick;
+SCB_Type       sim_scb;
+IWDG_TypeDef   sim_iwdg;
+DBGMCU_TypeDef sim_dbgmcu;
+RCC_TypeDef    sim_rcc;
+
+namespace {
+
+static_assert(sim::CYCLES_PER_MS == clock::SYSCLK_HZ/1000, "Simulator clock must match SYSCLK");
+
+/// Number of clock cycles in each SysTick millisecond
+constexpr uint64_t CYCLES_PER_MS = sim::CYCLES_PER_MS;
+
+/// Active exception priorities (lower number preempts higher)
+constexpr int PRIO_SYSTICK = 2;
+constexpr int PRIO_PENDSV  = 3;
+constexpr int PRIO_THREAD  = 4;
+
+/// Nominal IWDG LSI clock, and its prescaler
+constexpr uint64_t IWDG_LSI_HZ  = 40000;
+constexpr uint64_t IWDG_PRE_DIV = 64;
+
+/// IWDG key register values
+constexpr uint32_t IWDG_KEY_START  = 0xCCCC;
+constexpr uint32_t IWDG_KEY_RELOAD = 0xAAAA;
+
+/// Current virtual time
+uint64_t now_cycles = 0;
+
+/// Virtual time of the next SysTick
+uint64_t next_tick = CYCLES_PER_MS;
+
+/// Total virtual time spent asleep
+uint64_t total_sleep = 0;
+
+/// SysTick ticks taken so far
+uint32_t ticks = 0;
+
+/// Interrupts are masked
+bool primask = false;
+
+/// Exceptions pending
+bool systick_pending = false;
+bool pendsv_pending  = false;
+
+/// Priority of the running context
+int active_prio = PRIO_THREAD;
+
+/// SysTick has been started
+bool systick_on = false;
+
+/// Simulation end, and what to call when reached
+uint32_t end_ms = 0;
+void (*end_cb)(void) = nullptr;
+
+/// IWDG state
+bool     iwdg_on = false;
+uint64_t last_refresh = 0;
+sim::WatchdogStats wdt = { };
+
+/**
+ * @brief Gets the IWDG timeout, as currently configured
+ *
+ * @return clock cycles the IWDG would count before resetting the MCU
+ */
+uint64_t iwdg_timeout(void)
+{
+    return (static_cast<uint64_t>(IWDG->RLR)*IWDG_PRE_DIV*clock::SYSCLK_HZ)/IWDG_LSI_HZ;
+}
+
+/**
+ * @brief Counts a would-be reset if the IWDG has gone unrefreshed for too long
+ *
+ * The simulation carries on as if the watchdog had been refreshed, so later resets are still seen.
+ */
+void check_watchdog(void)
+{
+    if (iwdg_on && ((now_cycles - last_refresh) > iwdg_timeout())) {
+        wdt.resets++;
+        last_refresh = now_cycles;
+    }
+}
+
+/**
+ * @brief Moves time on to the next SysTick, pending it
+ */
+void tick(void)
+{
+    now_cycles = next_tick;
+    next_tick += CYCLES_PER_MS;
+    systick_pending = true;
+    check_watchdog();
+}
+
+/**
+ * @brief Sleeps until the next SysTick
+ */
+void sleep_to_tick(void)
+{
+    total_sleep += next_tick - now_cycles;
+    tick();
+}
+
+/**
+ * @brief Takes every pending interrupt that can preempt the running context
+ *
+ * When returning to thread mode from an interrupt with SLEEPONEXIT set, the core goes back to
+ * sleep until the next SysTick, just like the real core.
+ */
+void take_interrupts(void)
+{
+    bool took_isr = false;
+
+    while (!primask) {
+        if (systick_pending && (active_prio > PRIO_SYSTICK)) {
+            systick_pending = false;
+            int prev_prio = active_prio;
+            active_prio = PRIO_SYSTICK;
+            ticks++;
+            SysTick_Handler();
+            active_prio = prev_prio;
+            took_isr = true;
+
+            if ((end_cb != nullptr) && (ticks >= end_ms)) {
+                end_cb();
+            }
+        } else if (pendsv_pending && (active_prio > PRIO_PENDSV)) {
+            pendsv_pending = false;
+            int prev_prio = active_prio;
+            active_prio = PRIO_PENDSV;
+            PendSV_Handler();
+            active_prio = prev_prio;
+            took_isr = true;
+        } else if (took_isr && (active_prio == PRIO_THREAD) &&
+                ((SCB->SCR & SCB_SCR_SLEEPONEXIT_Msk) != 0)) {
+            sleep_to_tick();
+        } else {
+            break;
+        }
+    }
+}
+
+}  // namespace
+
+/// Mock of the SysTick current value register
+sim::SysTickVal::operator uint32_t() const
+{
+    return static_cast<uint32_t>((CYCLES_PER_MS - 1) - (now_cycles % CYCLES_PER_MS));
+}
+
+/// Mock of the ICSR register reads
+sim::IcsrReg::operator uint32_t() const
+{
+    return systick_pending ? SCB_ICSR_PENDSTSET_Msk : 0;
+}
+
+/// Mock of the ICSR register writes, pending PendSV takes it right away (if it can preempt)
+sim::IcsrReg &sim::IcsrReg::operator=(uint32_t val)
+{
+    if ((val & SCB_ICSR_PENDSVSET_Msk) != 0) {
+        pendsv_pending = true;
+        take_interrupts();
+    }
+    return *this;
+}
+
+/// Mock of the IWDG key register, tracks the gaps between refreshes
+sim::IwdgKr &sim::IwdgKr::operator=(uint32_t val)
+{
+    if (val == IWDG_KEY_START) {
+        iwdg_on = true;
+        last_refresh = now_cycles;
+    } else if (iwdg_on && (val == IWDG_KEY_RELOAD)) {
+        uint64_t gap = now_cycles - last_refresh;
+
+        wdt.refreshes++;
+        if (gap > wdt.max_gap_cycles) {
+            wdt.max_gap_cycles = gap;
+        }
+        last_refresh = now_cycles;
+    }
+    return *this;
+}
+
+void __disable_irq(void)
+{
+    primask = true;
+}
+
+void __enable_irq(void)
+{
+    primask = false;
+    take_interrupts();
+}
+
+void __WFI(void)
+{
+    if (!systick_pending && !pendsv_pending) {
+        sleep_to_tick();
+    }
+    take_interrupts();
+}
+
+uint32_t SysTick_Config(uint32_t)
+{
+    systick_on = true;
+    next_tick  = now_cycles + CYCLES_PER_MS;
+    return 0;
+}
+
+void sim::set_end(uint32_t ms, void (*done)(void))
+{
+    end_ms = ms;
+    end_cb = done;
+}
+
+uint64_t sim::now(void)
+{
+    return now_cycles;
+}
+
+/**
+ * @brief Spend clock cycles in the current context
+ *
+ * Interrupts taken along the way push the end of the work back by however long they took, since
+ * the preempted context doesn't run while they do.
+ *
+ * @param[in] cycles  clock cycles of work
+ */
+void sim::advance(uint64_t cycles)
+{
+    uint64_t end = now_cycles + cycles;
+
+    while (systick_on && (next_tick <= end)) {
+        tick();
+
+        uint64_t before = now_cycles;
+        take_interrupts();
+        end += now_cycles - before;
+    }
+
+    now_cycles = end;
+}
+
+uint64_t sim::sleep_cycles(void)
+{
+    return total_sleep;
+}
+
+/**
+ * @brief Get the watchdog refresh statistics
+ *
+ * The longest gap includes the time since the last refresh, so a watchdog that stopped being
+ * refreshed before the end still shows up.
+ *
+ * @return watchdog statistics
+ */
+sim::WatchdogStats sim::watchdog_stats(void)
+{
+    sim::WatchdogStats stats = wdt;
+    if (iwdg_on && ((now_cycles - last_refresh) > stats.max_gap_cycles)) {
+        stats.max_gap_cycles = now_cycles - last_refresh;
+    }
+    return stats;
+}
@@ -0,0 +1,61 @@
+/**
+ * @file      sim.hpp
+ * @brief     Virtual time core of the scheduler simulator
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Time only moves forward when simulated code spends it (`sim::advance()`), or the core sleeps.
+ * Each millisecond boundary crossed pends SysTick, and interrupts are taken at their NVIC priority
+ * (SysTick preempts PendSV, which preempts thread mode), as they would be on the Cortex-M0. The
+ * scheduler code itself is treated as taking no time.
+ */
+
+#ifndef SIM_HPP_
+#define SIM_HPP_
+
+#include <cstdint>
+
+/**
+ * @brief Simulator namespace
+ *
+ * Holds the virtual clock, and the interrupt/sleep model driving the real scheduler code.
+ */
+namespace sim {
+
+/// Clock cycles in each virtual millisecond/microsecond. must match `clock::SYSCLK_HZ`
+constexpr uint64_t CYCLES_PER_MS = 48000;
+constexpr uint64_t CYCLES_PER_US = CYCLES_PER_MS/1000;
+
+/// Watchdog refresh statistics
+struct WatchdogStats {
+    uint32_t refreshes;
+    uint32_t resets;
+    uint64_t max_gap_cycles;
+};
+
+/// Set the simulation length. once reached, `done` is called (and must not return)
+void set_end(uint32_t ms, void (*done)(void));
+
+/// Get the current virtual time, in clock cycles
+uint64_t now(void);
+
+/// Spend clock cycles in the current context, taking any interrupts that come due
+void advance(uint64_t cycles);
+
+/// Get the total clock cycles spent asleep
+uint64_t sleep_cycles(void);
+
+/// Get the watchdog refresh statistics
+WatchdogStats watchdog_stats(void);
+
+/// Print the firmware's debug output to stdout
+void set_verbose(bool on);
+
+/// Get the number of warnings the firmware printed
+unsigned debug_warnings(void);
+
+}  // namespace sim
+
+#endif  // SIM_HPP_
@@ -19,6 +19,7 @@
 #define BSP_QAZ_65_BSP_QAZ_65_HPP_
 
 #include "core/gpio.hpp"
+#include "keyboard/debounce.hpp"
 
 /**
  * @brief Board support package namespace
@@ -65,12 +66,42 @@ constexpr gpio::Id ROWS[] = {
     { gpio::A, gpio::PIN_0  },  // ROW04
 };
 
+/// Set if every key has a diode. without them, the key matrix blocks presses that could be ghosts
+constexpr bool KEY_DIODES = false;
+
+/// Set to scan the key matrix with DMA (TIM1/TIM3 and DMA channels 2-5), else the CPU scans it
+constexpr bool DMA_SCAN = false;
+
+/// Key debounce algorithm. eager gives presses no added latency
+constexpr debounce::Algorithm DEBOUNCE_ALGORITHM = debounce::EAGER;
+
+/// How long a key must read steady before the debouncer changes its state, in milliseconds
+constexpr unsigned DEBOUNCE_MS = 5;
+
+/// How long a tap-hold key must be held to act as its hold keycode, in milliseconds
+constexpr unsigned TAP_HOLD_MS = 200;
+
+/// Set to have a tap-hold key act as held if another key is pressed and released while it is held
+constexpr bool PERMISSIVE_HOLD = true;
+
+/// Set to have a tap-hold key act as held as soon as another key is pressed while it is held
+constexpr bool HOLD_ON_OTHER_PRESS = false;
+
+/// How long the keys of a combo have to all be pressed within, in milliseconds
+constexpr unsigned COMBO_MS = 30;
+
 /// bsp-specific initializations
 void init(void);
 
 }  // namespace bsp
 
-/// Base key symbol table
+/// Keymap layers, lowest first. a higher layer that is on takes priority over the ones below it
+///     table - key symbol table of the layer
+#define LAYER_TABLE(LAYER) \
+    LAYER(BASE_TABLE) \
+    LAYER(FN_TABLE)
+
+/// Base key symbol table - layer 0, always on
 ///     symbol - the symbol for the key. must match with HID_USAGE_KEYBOARD_* define
 #define BASE_TABLE(K) \
     K(ESC)   K(1)     K(2)     K(3)     K(4)     K(5)     K(6)     K(7)     K(8)     K(9)     K(0)     K(DASH)  K(EQUAL) K(BKSPC) K(GRAVE)  /* NOLINT */  \
@@ -79,14 +110,36 @@ void init(void);
     K(LSHFT) K(Z)     K(X)     K(C)     K(V)     K(B)     K(N)     K(M)     K(COMMA) K(PRIOD) K(FSLSH) K(RSHFT) K(NONE)  K(UARRW) K(DELET)  /* NOLINT */  \
     K(LCTRL) K(LGUI)  K(LALT)  K(NONE)  K(NONE)  K(SPACE) K(NONE)  K(NONE)  K(RALT)  K(FN)    K(RCTRL) K(LARRW) K(NONE)  K(DARRW) K(RARRW)  /* NOLINT */
 
-/// Fn key symbol table - for when the FN key is pressed
+/// Fn key symbol table - layer 1, on while the FN key is held
 ///     symbol - the symbol for the key. must match with HID_USAGE_KEYBOARD_* define
 #define FN_TABLE(K) \
     K(NONE)  K(F1)    K(F2)    K(F3)    K(F4)    K(F5)    K(F6)    K(F7)    K(F8)    K(F9)    K(F10)   K(F11)   K(F12)   K(NONE)  K(PROF)   /* NOLINT */ \
     K(NONE)  K(R_UP)  K(G_UP)  K(B_UP)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(BRTUP)  /* NOLINT */ \
     K(NONE)  K(R_DN)  K(G_DN)  K(B_DN)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(BRTDN)  /* NOLINT */ \
-    K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)   /* NOLINT */ \
-    K(LCTRL) K(LGUI)  K(LALT)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(RALT)  K(FN)    K(RCTRL) K(SPDDN) K(NONE)  K(NONE)  K(SPDUP)  /* NOLINT */
+    K(NONE)  K(NONE)  K(NONE)  K(MC(0)) K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)   /* NOLINT */ \
+    K(TRNS)  K(TRNS)  K(TRNS)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(NONE)  K(TRNS)  K(TRNS)  K(TRNS)  K(SPDDN) K(NONE)  K(NONE)  K(SPDUP)  /* NOLINT */
+
+/// Combos, a keycode for pressing a set of keys together (within `COMBO_MS`)
+///     code - the symbol of the combo's keycode. must match with HID_USAGE_KEYBOARD_* define
+///     keys - K(symbol) of each key in the combo (2 to 8), by its symbol in the base table
+#define COMBO_TABLE(COMBO, K) \
+    COMBO(CPLCK, K(LSHFT) K(RSHFT))
+
+/// Macros, each a sequence of keycodes sent to the host. played by a MC(index) key
+///     name  - name of the macro
+///     steps - TAP(symbol), DOWN(symbol), or UP(symbol) for each step, symbols as in the key tables
+#define MACRO_TABLE(MACRO, TAP, DOWN, UP) \
+    MACRO(COPY_ALL, DOWN(LCTRL) TAP(A) TAP(C) UP(LCTRL))
+
+/// Tasks ran by the timeslice scheduler, in the order they are ran when due at the same time
+///     module    - namespace of the module. its task function must be `module::task`
+///     prio      - priority class (see timeslice::Priority). HIGH tasks preempt LOW tasks
+///     budget_us - longest a single task call should take, in microseconds
+#define TASK_TABLE(TASK) \
+    TASK(heartbeat, LOW,  100)  \
+    TASK(keymatrix, HIGH, 1000) \
+    TASK(lighting,  LOW,  5000) \
+    TASK(kb_hid,    HIGH, 200)
 
 /// Which keys get a callback function
 #define CALLBACK_KEY_TABLE(K) \
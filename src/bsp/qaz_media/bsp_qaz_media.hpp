@@ -60,6 +60,16 @@ void init(void);
 
 }  // namespace bsp
 
+/// Tasks ran by the timeslice scheduler, in the order they are ran when due at the same time
+///     module    - namespace of the module. its task function must be `module::task`
+///     prio      - priority class (see timeslice::Priority). HIGH tasks preempt LOW tasks
+///     budget_us - longest a single task call should take, in microseconds
+#define TASK_TABLE(TASK) \
+    TASK(heartbeat,      LOW,  100) \
+    TASK(buttons,        HIGH, 100) \
+    TASK(rotary_encoder, HIGH, 100) \
+    TASK(consumer_hid,   HIGH, 200)
+
 /// USART used for sending debug messages
 #define DEBUG_UART USART1
 
@@ -0,0 +1,110 @@
+/**
+ * @file      event.cpp
+ * @brief     System event queue
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * IRQ handlers post events into a lock-free ring, which the timeslice loop drains every time
+ * through. Posting an event also wakes the loop if it is sleeping, so events are dispatched as
+ * soon as the IRQ handler returns rather than at the next task deadline.
+ *
+ * The ring has a single producer, so every IRQ handler that posts must run at the same NVIC
+ * priority (so one can't preempt another mid-post). If the ring is full, the event is dropped and
+ * counted.
+ */
+
+#include "core/event.hpp"
+
+#include <cstdint>
+
+#include "core/ring.hpp"
+#include "util/bitop.hpp"
+#include "stm32f0xx.h"  // NOLINT
+
+namespace event {
+
+/// Default implementation of the handlers does nothing
+#define EVENT(name) __WEAK void handle_##name(const Event &) {}
+EVENT_TABLE(EVENT)
+#undef EVENT
+
+}  // namespace event
+
+namespace {
+
+/// Events posted, but not yet dispatched
+Ring<event::Event, event::QUEUE_SIZE> queue;
+
+/// Number of events dropped because the queue was full
+volatile uint32_t overflows = 0;
+
+}  // namespace
+
+/**
+ * @brief Post an event
+ *
+ * The loop is woken (if sleeping) once the calling IRQ handler returns, so the event is dispatched
+ * right away.
+ *
+ * @param[in] type  event type
+ * @param[in] data  event payload
+ *
+ * @return true if the event was posted, false if the queue was full and the event was dropped
+ */
+bool event::post(event::Type type, uint16_t data)
+{
+    if (!queue.push({ type, data })) {
+        overflows++;
+        return false;
+    }
+
+    bitop::clr_msk(SCB->SCR, SCB_SCR_SLEEPONEXIT_Msk);
+
+    return true;
+}
+
+/**
+ * @brief Dispatch every waiting event
+ *
+ * Handlers are called from the timeslice loop (so at LOW priority), in the order the events were
+ * posted. Events posted by the handlers themselves are dispatched before returning.
+ */
+void event::dispatch(void)
+{
+    event::Event evt;
+
+    while (queue.pop(evt)) {
+        switch (evt.type) {
+#define EVENT(name)                 \
+        case event::name:           \
+            event::handle_##name(evt); \
+            break;
+        EVENT_TABLE(EVENT)
+#undef EVENT
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Check if there are events waiting
+ *
+ * @return true if there is at least one event waiting to be dispatched
+ */
+bool event::is_pending(void)
+{
+    return !queue.is_empty();
+}
+
+/**
+ * @brief Get the number of dropped events
+ *
+ * @return number of events dropped because the queue was full
+ */
+uint32_t event::get_overflows(void)
+{
+    return overflows;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file      event.hpp
+ * @brief     System event queue
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * IRQ handlers post events here rather than doing their work inside the IRQ. The events are
+ * dispatched from the timeslice loop, each to the handler for its event type. This keeps the IRQ
+ * handlers short, and lets modules react to events instead of polling for them.
+ *
+ * Each event type has a handler function, defined as __weak in the source file:
+ *     void event::handle_X(const event::Event &evt)
+ * where X is the name given in EVENT_TABLE. A module that wants an event overrides its handler.
+ */
+
+#ifndef CORE_EVENT_HPP_
+#define CORE_EVENT_HPP_
+
+#include <cstdint>
+
+/// Event type table
+///     name - name of the event type, and its handler `event::handle_<name>`
+#define EVENT_TABLE(EVENT) \
+    EVENT(USB_RESET)       \
+    EVENT(USB_SUSPEND)     \
+    EVENT(USB_RESUME)      \
+    EVENT(USB_VENDOR)
+
+/**
+ * @brief System event namespace
+ *
+ * This namespace holds the API for posting events from IRQ handlers, and dispatching them from the
+ * timeslice loop.
+ */
+namespace event {
+
+/// Number of events that can be waiting to be dispatched
+constexpr unsigned QUEUE_SIZE = 16;
+
+/// Macro expand an enum for each event type
+enum Type : uint8_t {
+#define EVENT(name) name,
+    EVENT_TABLE(EVENT)
+#undef EVENT
+};
+
+/// An event, with a small payload whose meaning depends on the event type
+struct Event {
+    Type type;
+    uint16_t data;
+};
+
+/// Post an event to be dispatched by the loop. IRQ handlers posting must share an NVIC priority
+bool post(Type type, uint16_t data = 0);
+
+/// Dispatch every waiting event to its handler. only called by the timeslice loop
+void dispatch(void);
+
+/// Check if there are events waiting to be dispatched
+bool is_pending(void);
+
+/// Get the number of events dropped because the queue was full
+uint32_t get_overflows(void);
+
+/// Macro expand the handler of each event type
+#define EVENT(name) void handle_##name(const Event &evt);
+EVENT_TABLE(EVENT)
+#undef EVENT
+
+}  // namespace event
+
+#endif  // CORE_EVENT_HPP_
@@ -117,6 +117,13 @@ enum PinState : uint32_t {
     SET = 0x1,
 };
 
+/// Edges an EXTI line triggers on
+enum Edge {
+    RISING_EDGE,
+    FALLING_EDGE,
+    BOTH_EDGES,
+};
+
 /// What type of active config does an input have
 enum InputConfig {
     ACTIVE_LOW,
@@ -144,6 +151,19 @@ inline volatile GPIO_TypeDef *regs(Id id)
     return reinterpret_cast<GPIO_TypeDef *>(id.port);
 }
 
+/**
+ * @brief Convert port value to port structure
+ *
+ * For whole-port access, where there is no single pin of interest.
+ *
+ * @param[in] port  gpio port
+ * @return    gpio  structure pointer
+ */
+inline volatile GPIO_TypeDef *regs(Port port)
+{
+    return reinterpret_cast<GPIO_TypeDef *>(port);
+}
+
 /**
  * @brief Enable the given port clock
  *
@@ -312,6 +332,75 @@ inline PinState read_input(Id id)
     return static_cast<PinState>(bitop::read_bit(regs(id)->IDR, id.pin));
 }
 
+/**
+ * @brief Get the EXTI IRQ that a GPIO's EXTI line is handled by
+ *
+ * EXTI lines 0-1, 2-3, and 4-15 each share an IRQ.
+ *
+ * @param[in] id  identification for gpio
+ *
+ * @return IRQ number of the gpio's EXTI line
+ */
+constexpr IRQn_Type exti_irq(Id id)
+{
+    return (id.pin <= PIN_1) ? EXTI0_1_IRQn : (id.pin <= PIN_3) ? EXTI2_3_IRQn : EXTI4_15_IRQn;
+}
+
+/**
+ * @brief Route the GPIO to its EXTI line
+ *
+ * Each EXTI line can only be routed to one of the ports' pins with the same number (e.g. line 3 is
+ * one of PA3, PB3, ...). The ports are 0x400 apart, starting at GPIOA. The line is left masked, see
+ * `enable_exti`.
+ *
+ * @param[in] id    identification for gpio
+ * @param[in] edge  the edge(s) to trigger on
+ */
+inline void set_exti(Id id, Edge edge)
+{
+    bitop::set_msk(RCC->APB2ENR, RCC_APB2ENR_SYSCFGCOMPEN);
+
+    uint32_t port_idx = (id.port - GPIOA_BASE)/0x400;
+    bitop::update_msk(SYSCFG->EXTICR[id.pin/4], 0xFu << (id.pin % 4)*4, port_idx << (id.pin % 4)*4);
+
+    bitop::update_bit(EXTI->RTSR, id.pin, (edge != FALLING_EDGE) ? 1 : 0);
+    bitop::update_bit(EXTI->FTSR, id.pin, (edge != RISING_EDGE) ? 1 : 0);
+}
+
+/**
+ * @brief Unmask the GPIO's EXTI line
+ *
+ * Any edge seen while masked is cleared first, so only edges from now on trigger the IRQ.
+ *
+ * @param[in] id  identification for gpio
+ */
+inline void enable_exti(Id id)
+{
+    EXTI->PR = 1u << id.pin;
+    bitop::set_bit(EXTI->IMR, id.pin);
+}
+
+/**
+ * @brief Clear a pending edge of the GPIO's EXTI line, leaving it unmasked
+ *
+ * @param[in] id  identification for gpio
+ */
+inline void clear_exti(Id id)
+{
+    EXTI->PR = 1u << id.pin;
+}
+
+/**
+ * @brief Mask the GPIO's EXTI line, and clear any pending edge
+ *
+ * @param[in] id  identification for gpio
+ */
+inline void disable_exti(Id id)
+{
+    bitop::clr_bit(EXTI->IMR, id.pin);
+    EXTI->PR = 1u << id.pin;
+}
+
 }  // namespace gpio
 
 #endif  // CORE_GPIO_HPP_
@@ -14,6 +14,7 @@
 #include "bsp/bsp.hpp"
 #include "core/clock.hpp"
 #include "core/time_slice.hpp"
+#include "core/timer.hpp"
 #include "flash/persist.hpp"
 #include "util/debug.hpp"
 #include "util/hb.hpp"
@@ -23,6 +24,7 @@ int main(void)
     // inits - specifically ordered
     clock::init();
     debug::init();
+    timer::init();
     timeslice::init();
     persist::init();
     heartbeat::init();
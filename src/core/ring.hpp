@@ -0,0 +1,117 @@
+/**
+ * @file      ring.hpp
+ * @brief     Lock-free single producer, single consumer ring buffer
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Fixed capacity ring buffer, for passing items from one context (e.g. an IRQ handler) to another
+ * (e.g. the timeslice loop) without masking interrupts. The producer only ever writes the head
+ * index, and the consumer only ever writes the tail index, so neither can corrupt the other.
+ *
+ * The indices free run, and are only masked when indexing the buffer. So the capacity must be a
+ * power of 2, and the full/empty states don't need a wasted slot to tell them apart.
+ */
+
+#ifndef CORE_RING_HPP_
+#define CORE_RING_HPP_
+
+#include "stm32f0xx.h"  // NOLINT
+
+/**
+ * @brief Ring buffer class
+ *
+ * Only one context may push, and only one context may pop. A push can't be interrupted by another
+ * push, so producers in different IRQ handlers must run at the same NVIC priority.
+ *
+ * @tparam T  type of the items held
+ * @tparam N  capacity, in items. must be a power of 2
+ */
+template <typename T, unsigned N>
+class Ring {
+    static_assert((N != 0) && ((N & (N - 1)) == 0), "Ring capacity must be a power of 2");
+
+ public:
+    /// Add an item at the head, fails if full. producer only
+    inline bool push(const T &item);
+
+    /// Remove the item at the tail, fails if empty. consumer only
+    inline bool pop(T &item);
+
+    /// Check if there are no items
+    inline bool is_empty(void) const;
+
+ private:
+    /// Item storage, indexed by the masked head/tail
+    T _buf[N];
+
+    /// Number of items ever pushed, only written by the producer
+    volatile unsigned _head = 0;
+
+    /// Number of items ever popped, only written by the consumer
+    volatile unsigned _tail = 0;
+};
+
+/**
+ * @brief Add an item at the head
+ *
+ * The item is fully written before the head is advanced, so the consumer can never see a partial
+ * item.
+ *
+ * @param[in] item  item to add
+ *
+ * @return true if the item was added, false if the ring is full
+ */
+template <typename T, unsigned N>
+inline bool Ring<T, N>::push(const T &item)
+{
+    unsigned head = _head;
+    if ((head - _tail) >= N) {
+        return false;
+    }
+
+    _buf[head & (N - 1)] = item;
+    __COMPILER_BARRIER();
+    _head = head + 1;
+
+    return true;
+}
+
+/**
+ * @brief Remove the item at the tail
+ *
+ * The item is fully read before the tail is advanced, so the producer can never overwrite it while
+ * it is being read.
+ *
+ * @param[out] item  filled with the removed item
+ *
+ * @return true if an item was removed, false if the ring is empty
+ */
+template <typename T, unsigned N>
+inline bool Ring<T, N>::pop(T &item)
+{
+    unsigned tail = _tail;
+    if (tail == _head) {
+        return false;
+    }
+
+    item = _buf[tail & (N - 1)];
+    __COMPILER_BARRIER();
+    _tail = tail + 1;
+
+    return true;
+}
+
+/**
+ * @brief Check if there are no items
+ *
+ * @return true if the ring is empty
+ */
+template <typename T, unsigned N>
+inline bool Ring<T, N>::is_empty(void) const
+{
+    return _tail == _head;
+}
+
+#endif  // CORE_RING_HPP_
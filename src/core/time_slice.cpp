@@ -6,12 +6,46 @@
  * @date      2020/10/12
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
- * Core time slice loop scheduler, which will use the SysTick timer to execute a loop at a set
- * LOOP_PERIOD_MS period. It will count these loops to execute given tasks at a specified period.
- * This gives program execution a concept of timing periodicity.
+ * Core time slice loop scheduler, which will use the SysTick timer to count milliseconds. Each
+ * registered task has a deadline (the millisecond count at which it is next due), and the tasks
+ * are kept in a queue ordered by deadline. The loop runs every task that is due, then sleeps until
+ * the earliest deadline. This gives program execution a concept of timing periodicity, without
+ * quantizing task periods to a loop period.
  *
- * If the loop manager detects an overrun of the loop period, it will complain, but will continue
- * the loop as normal.
+ * The tasks are set at compile time by the BSP's `TASK_TABLE`, so the task registry is sized
+ * exactly, and each task function is called directly rather than through a function pointer.
+ *
+ * Tasks are split into two priority classes by the task table. LOW priority tasks are ran
+ * cooperatively by the loop in thread mode. HIGH priority tasks are ran from the PendSV handler,
+ * which the SysTick handler pends whenever one is due, so they preempt any LOW priority task that
+ * is running. Each class has its own deadline queue. `timeslice::lock()` holds off HIGH priority
+ * tasks while data shared with them is being accessed.
+ *
+ * While sleeping, the SLEEPONEXIT bit is used so that the core goes right back to sleep after
+ * every interrupt. Only once the SysTick handler sees the programmed wakeup deadline, or an IRQ
+ * handler posts an event, is the loop allowed to resume. Posted events are dispatched by the loop
+ * before it runs any LOW priority task.
+ *
+ * Each task's first deadline is offset from the loop start by its phase. Phases that aren't given
+ * at registration are picked automatically so that tasks are released in different milliseconds
+ * whenever possible, spreading the work out rather than piling it up in the same tick.
+ *
+ * A task can suspend itself while it has nothing to do (e.g. waiting on an interrupt), taking it
+ * out of its deadline queue. Once resumed, it is due right away, and carries on with its period
+ * from there. IRQ handlers can resume HIGH priority tasks directly, through the PendSV handler. A task's period can also be changed at runtime, taking effect from its next release.
+ *
+ * If the loop manager detects a task has missed an entire period, it will complain, but will
+ * continue the loop as normal. Every task also has a time budget set in the task table, and calls
+ * that go over budget or miss a deadline are counted per task.
+ *
+ * The IWDG independent watchdog backs this up. Time is split into windows, and the watchdog is only
+ * refreshed at the end of a window in which no task missed a deadline and no task has fallen a
+ * whole period behind. A hung task (or one that is always late) therefore resets the MCU.
+ *
+ * Every task call is timed in clock cycles by combining the millisecond count with the SysTick
+ * current value register. Per task, the number of calls, the min/max/mean durations, and a log2
+ * histogram of durations are kept. Time spent in preempting HIGH priority tasks is not counted
+ * against the LOW priority task that was preempted.
  *
  * The SysTick timer shall not be used for anything else...
  */
@@ -20,69 +54,665 @@
 
 #include <cstdint>
 
+#include "bsp/bsp.hpp"
 #include "core/clock.hpp"
+#include "core/event.hpp"
+#include "util/bitop.hpp"
 #include "util/debug.hpp"
 #include "stm32f0xx.h"  // NOLINT
 
-/// Systick handler needs C linkage
+/// Systick and PendSV handlers need C linkage
 extern "C" void SysTick_Handler(void);
+extern "C" void PendSV_Handler(void);
+
+/// Declare the task function of every module in the task table
+#define TASK(module, prio, budget_us) namespace module { void task(void); }
+TASK_TABLE(TASK)
+#undef TASK
 
 namespace {
 
-/// Each registered task has an info struct
+/// Macro expand an ID for each task in the task table. the last value is the number of tasks
+enum TaskId : uint8_t {
+#define TASK(module, prio, budget_us) TASK_##module,
+    TASK_TABLE(TASK)
+#undef TASK
+    NUM_TASKS,
+};
+
+/// Macro expand the task function of each task, only used for finding a task by its function
+constexpr void (*const task_funcs[NUM_TASKS])(void) = {
+#define TASK(module, prio, budget_us) module::task,
+    TASK_TABLE(TASK)
+#undef TASK
+};
+
+/// Macro expand the name of each task, for debug output
+constexpr const char *task_names[NUM_TASKS] = {
+#define TASK(module, prio, budget_us) #module,
+    TASK_TABLE(TASK)
+#undef TASK
+};
+
+/// Macro expand the priority class of each task
+constexpr timeslice::Priority task_prios[NUM_TASKS] = {
+#define TASK(module, prio, budget_us) timeslice::prio,
+    TASK_TABLE(TASK)
+#undef TASK
+};
+
+/// SysTick must be able to preempt PendSV, so HIGH priority tasks are released while others run
+constexpr uint32_t SYSTICK_IRQ_PRIO = 2;
+
+/// PendSV is below every other interrupt, so HIGH priority tasks never hold off a peripheral IRQ
+constexpr uint32_t PENDSV_IRQ_PRIO = 3;
+
+/// Number of SysTick clock cycles in each millisecond tick
+constexpr uint32_t CYCLES_PER_MS = clock::SYSCLK_HZ/1000;
+
+/// Number of SysTick clock cycles in each microsecond
+constexpr uint32_t CYCLES_PER_US = clock::SYSCLK_HZ/1000000;
+
+/// Macro expand the time budget of each task, in clock cycles
+constexpr uint32_t task_budgets[NUM_TASKS] = {
+#define TASK(module, prio, budget_us) (budget_us)*CYCLES_PER_US,
+    TASK_TABLE(TASK)
+#undef TASK
+};
+
+/// Length of each watchdog window, in milliseconds
+constexpr uint32_t WDT_WINDOW_MS = 1000;
+
+/// IWDG counts the ~40kHz LSI divided by 64
+constexpr uint32_t IWDG_PRESCALER = IWDG_PR_PR_2;
+
+/// IWDG timeout of ~3s (2.4s to 4.8s across LSI tolerance), so missing two windows is survived
+constexpr uint32_t IWDG_RELOAD = (3*40000)/64;
+
+/// IWDG key register values
+constexpr uint32_t IWDG_KEY_START  = 0xCCCC;
+constexpr uint32_t IWDG_KEY_ACCESS = 0x5555;
+constexpr uint32_t IWDG_KEY_RELOAD = 0xAAAA;
+
+/// Execution statistics kept for each task
+struct task_stats {
+    uint32_t calls;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+    uint32_t hist[timeslice::HIST_BUCKETS];
+    uint32_t budget_misses;
+    uint32_t deadline_misses;
+};
+
+/// Each task in the task table has an info struct. a task with period 0 is not registered. the
+/// deadline is normally the periodic release, unless the task asked to resume at the next tick. a
+/// suspended task is in neither deadline queue, and neither is a task while it is running
 struct task_info {
-    unsigned loop_cnt;
-    unsigned loops_per_period;
-    void (*task_func)(void);
+    uint32_t deadline;
+    uint32_t release;
+    unsigned period;
+    unsigned phase;
+    bool resume_early;
+    bool suspended;
+    bool running;
+    task_stats stats;
 };
 
 /// The current number of milliseconds elapsed
 volatile uint32_t ms_cnt = 0;
 
-/// The millisecond count the last time the manager task ran
-uint32_t last_ms = 0;
+/// The millisecond count at which the sleeping loop must be woken
+volatile uint32_t wakeup_ms = 0;
 
-/// Total tasks registered. can never be > MAX_NUM_TASKS
+/// Total tasks registered. can never be > NUM_TASKS
 unsigned ntasks = 0;
 
-/// Task registry is just an array of task info, filled with each register
-task_info task_registry[timeslice::MAX_NUM_TASKS] = { };
+/// ID of the task currently being ran (at the highest active priority), NUM_TASKS if none
+unsigned running_task = NUM_TASKS;
+
+/// Task registry is an array of task info, one for each task in the task table
+task_info task_registry[NUM_TASKS] = { };
+
+/// Registered task IDs of one priority class, ordered by deadline (earliest deadline first)
+struct task_queue {
+    uint8_t ids[NUM_TASKS];
+    unsigned len;
+};
+
+/// Deadline queue of LOW priority tasks, only touched by the loop
+task_queue low_queue = { };
+
+/// Deadline queue of HIGH priority tasks, only touched by the PendSV handler once the loop starts
+task_queue high_queue = { };
+
+/// Deadline at the head of the HIGH priority queue, for the SysTick handler to check
+volatile uint32_t high_deadline = 0;
+
+/// Nesting depth of `timeslice::lock()`. HIGH priority tasks are held off while non-zero
+volatile unsigned lock_depth = 0;
+
+/// Set if PendSV was taken while locked, so it must be pended again when unlocked
+volatile bool pendsv_deferred = false;
+
+/// HIGH priority tasks resumed by IRQ handlers (a bit per task ID), for the PendSV handler to take
+volatile uint32_t isr_resumes = 0;
+
+static_assert(NUM_TASKS <= 32, "A bit for each task in the IRQ resume mask");
+
+/// Total clock cycles spent running HIGH priority tasks from PendSV
+volatile uint32_t preempt_cycles = 0;
+
+/// Millisecond count at which the current watchdog window ends
+uint32_t window_end = 0;
+
+/// Set if any task missed a deadline in the current watchdog window
+volatile bool window_missed = false;
+
+/// Number of watchdog windows that ended without refreshing the watchdog
+uint32_t missed_windows = 0;
+
+/// A deadline miss, kept for the loop to report
+struct overrun_info {
+    unsigned task;
+    uint32_t late_ms;
+    uint32_t task_cycles;
+};
+
+/// Last deadline miss. only written by `run_next_task()`, which may be in PendSV
+overrun_info last_overrun = { };
+
+/// Deadline misses since the loop last reported one
+volatile uint32_t unreported_overruns = 0;
+
+/**
+ * @brief Calls a task function
+ *
+ * Every task function is known at compile time, so each is called directly (and can be inlined)
+ * rather than through a function pointer.
+ *
+ * @param[in] id  ID of the task to call
+ */
+inline void call_task(unsigned id)
+{
+    switch (id) {
+#define TASK(module, prio, budget_us) \
+    case TASK_##module:               \
+        module::task();               \
+        break;
+    TASK_TABLE(TASK)
+#undef TASK
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Finds a task in the task table by its function
+ *
+ * @param[in] task_func  task function to find
+ *
+ * @return ID of the task, NUM_TASKS if the function is not in the task table
+ */
+unsigned find_task(void (*task_func)(void))
+{
+    unsigned id = 0;
+    while ((id < NUM_TASKS) && (task_funcs[id] != task_func)) {
+        id++;
+    }
+    return id;
+}
+
+/**
+ * @brief Checks if a deadline has been reached
+ *
+ * The difference is taken as signed, so this stays correct across tick overflow (as long as the
+ * deadline is within ~24 days of the current time).
+ *
+ * @param[in] deadline  millisecond count to check
+ * @param[in] now       current millisecond count
+ *
+ * @return if `now` is at or past `deadline`
+ */
+inline bool is_due(uint32_t deadline, uint32_t now)
+{
+    return static_cast<int32_t>(now - deadline) >= 0;
+}
+
+/**
+ * @brief Inserts a task into a deadline queue
+ *
+ * The task is inserted after every task with an earlier or equal deadline. This keeps task table
+ * order for tasks that are due at the same time.
+ *
+ * @param[in,out] queue  deadline queue to insert into
+ * @param[in]     idx    task registry index to insert
+ */
+void queue_insert(task_queue &queue, unsigned idx)
+{
+    unsigned pos = queue.len;
+
+    // shift later deadlines back one slot, until we find where we belong
+    while ((pos > 0) && !is_due(task_registry[queue.ids[pos - 1]].deadline,
+                task_registry[idx].deadline)) {
+        queue.ids[pos] = queue.ids[pos - 1];
+        pos--;
+    }
+
+    queue.ids[pos] = idx;
+    queue.len++;
+}
+
+/**
+ * @brief Pops the earliest task from a deadline queue
+ *
+ * @param[in,out] queue  deadline queue to pop from, must not be empty
+ *
+ * @return task registry index of the task with the earliest deadline
+ */
+unsigned queue_pop(task_queue &queue)
+{
+    unsigned idx = queue.ids[0];
+
+    queue.len--;
+    for (unsigned i = 0; i < queue.len; ++i) {
+        queue.ids[i] = queue.ids[i + 1];
+    }
+
+    return idx;
+}
+
+/**
+ * @brief Checks if the task at the head of a deadline queue is due
+ *
+ * @param[in] queue  deadline queue to check
+ *
+ * @return if the queue isn't empty, and its earliest deadline has been reached
+ */
+inline bool head_is_due(const task_queue &queue)
+{
+    return (queue.len != 0) && is_due(task_registry[queue.ids[0]].deadline, ms_cnt);
+}
+
+/**
+ * @brief Greatest common divisor
+ *
+ * @param[in] a  first value
+ * @param[in] b  second value
+ *
+ * @return greatest common divisor of `a` and `b`
+ */
+unsigned gcd(unsigned a, unsigned b)
+{
+    while (b != 0) {
+        unsigned rem = a % b;
+        a = b;
+        b = rem;
+    }
+    return a;
+}
+
+/**
+ * @brief Picks the phase for a task that will collide the least with already placed tasks
+ *
+ * Two tasks with periods Ta/Tb and phases Pa/Pb are released in the same millisecond iff
+ * Pa = Pb (mod gcd(Ta, Tb)), and when they do, it happens for gcd(Ta, Tb)/Tb of the task's
+ * releases. Every phase in [0, period) is tried, and the one with the lowest total collision rate
+ * wins (the earliest one, for ties).
+ *
+ * @param[in] id      ID of the task to place
+ * @param[in] placed  which tasks already have their phase set
+ *
+ * @return the chosen phase, in milliseconds
+ */
+unsigned pick_phase(unsigned id, const bool placed[NUM_TASKS])
+{
+    const unsigned period = task_registry[id].period;
+    unsigned best_phase   = 0;
+    unsigned best_cost    = UINT32_MAX;
+
+    for (unsigned phase = 0; (phase < period) && (best_cost != 0); ++phase) {
+        unsigned cost = 0;
+
+        for (unsigned j = 0; j < NUM_TASKS; ++j) {
+            if (!placed[j]) {
+                continue;
+            }
+
+            unsigned g = gcd(period, task_registry[j].period);
+            if ((phase % g) == (task_registry[j].phase % g)) {
+                // scaled up, so the rate of small collisions doesn't round down to nothing
+                cost += (g << 10)/task_registry[j].period;
+            }
+        }
+
+        if (cost < best_cost) {
+            best_cost  = cost;
+            best_phase = phase;
+        }
+    }
+
+    return best_phase;
+}
+
+/**
+ * @brief Sets the phase of every task registered with `timeslice::AUTO_PHASE`
+ *
+ * Tasks given an explicit phase are placed first, then the rest are placed one by one (in task
+ * table order) around the ones already placed.
+ */
+void place_phases(void)
+{
+    bool placed[NUM_TASKS];
+
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        placed[i] = (task_registry[i].period != 0) &&
+            (task_registry[i].phase != timeslice::AUTO_PHASE);
+    }
+
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        if ((task_registry[i].period != 0) && !placed[i]) {
+            task_registry[i].phase = pick_phase(i, placed);
+            placed[i] = true;
+        }
+    }
+}
+
+/**
+ * @brief Clears a task's execution statistics
+ *
+ * @param[out] stats  statistics to clear
+ */
+void clear_stats(task_stats &stats)
+{
+    stats.calls        = 0;
+    stats.min_cycles   = UINT32_MAX;
+    stats.max_cycles   = 0;
+    stats.total_cycles = 0;
+    for (unsigned i = 0; i < timeslice::HIST_BUCKETS; ++i) {
+        stats.hist[i] = 0;
+    }
+    stats.budget_misses   = 0;
+    stats.deadline_misses = 0;
+}
+
+/**
+ * @brief Records a single task call duration
+ *
+ * The histogram bucket is found by shifting the duration down until it is gone, which is the
+ * (offset) log2 of the duration. Durations too long for the last bucket are counted in it.
+ *
+ * @param[in,out] stats   statistics to update
+ * @param[in]     cycles  duration of task call, in clock cycles
+ * @param[in]     budget  time budget of the task, in clock cycles
+ */
+void record_duration(task_stats &stats, uint32_t cycles, uint32_t budget)
+{
+    stats.calls++;
+    if (cycles > budget) {
+        stats.budget_misses++;
+    }
+
+    stats.total_cycles += cycles;
+
+    if (cycles < stats.min_cycles) {
+        stats.min_cycles = cycles;
+    }
+    if (cycles > stats.max_cycles) {
+        stats.max_cycles = cycles;
+    }
+
+    unsigned bucket = 0;
+    for (uint32_t x = cycles >> (timeslice::HIST_BASE_LOG2 + 1); x != 0; x >>= 1) {
+        if (bucket >= (timeslice::HIST_BUCKETS - 1)) {
+            break;
+        }
+        bucket++;
+    }
+    stats.hist[bucket]++;
+}
 
 /**
- * @brief Manages timing loops
+ * @brief Waits until the given deadline, or until an event is posted
  *
- * This "task" regulates the timing of the loop to the given loop period. It does this by saving
- * the previous ms count, and comparing it to the current ms count. It will wait out any remaining
- * time until the loop period is achieved.
+ * The wakeup deadline is programmed for the SysTick handler, then the core sleeps with
+ * SLEEPONEXIT set, so no thread code runs until the deadline is reached or an event is posted.
+ * Interrupts are masked while checking, so a tick or event can't sneak in between the check and
+ * the WFI (a pending interrupt still wakes the core from WFI with PRIMASK set).
  *
- * If the calculated elapsed time is greater than the loop period, some task must have overran. The
- * function may be hanging, or the loop period must be increased.
+ * @param[in] deadline  millisecond count to wait until
  */
-void manager_task(void)
+void sleep_until(uint32_t deadline)
 {
-    uint32_t elapsed_ms;
+    if (!timeslice::SLEEP_WHEN_IDLE) {
+        while (!is_due(deadline, ms_cnt) && !event::is_pending()) {}
+        return;
+    }
 
-    // copy value now, it can change at any time
+    __disable_irq();
+    wakeup_ms = deadline;
+    if (!is_due(deadline, ms_cnt) && !event::is_pending()) {
+        bitop::set_msk(SCB->SCR, SCB_SCR_SLEEPONEXIT_Msk);
+        __WFI();
+    }
+    __enable_irq();
+}
+
+/**
+ * @brief Starts the IWDG watchdog
+ *
+ * The watchdog is frozen while the core is halted by a debugger. Once started, it can't be stopped.
+ */
+void start_watchdog(void)
+{
+    bitop::set_msk(RCC->APB2ENR, RCC_APB2ENR_DBGMCUEN);
+    bitop::set_msk(DBGMCU->APB1FZ, DBGMCU_APB1_FZ_DBG_IWDG_STOP);
+
+    // starting the IWDG also starts the LSI
+    IWDG->KR  = IWDG_KEY_START;
+    IWDG->KR  = IWDG_KEY_ACCESS;
+    IWDG->PR  = IWDG_PRESCALER;
+    IWDG->RLR = IWDG_RELOAD;
+
+    // wait for the prescaler/reload to be taken by the LSI clock domain
+    while (IWDG->SR != 0) {}
+
+    IWDG->KR = IWDG_KEY_RELOAD;
+}
+
+/**
+ * @brief Ends the watchdog window, if it is over
+ *
+ * The watchdog is only refreshed if no task missed a deadline during the window, and no task is
+ * currently a whole period (or more) behind. The latter catches a task that is stuck, or stuck
+ * waiting behind another, which hasn't had the chance to miss its deadline yet. Called from the
+ * loop, so a hung loop also stops the refreshes.
+ */
+void service_watchdog(void)
+{
     uint32_t current_ms = ms_cnt;
+    if (!is_due(window_end, current_ms)) {
+        return;
+    }
+    window_end = current_ms + WDT_WINDOW_MS;
 
-    if (current_ms >= last_ms) {
-        // find the time we spent in the loop so far
-        elapsed_ms = current_ms - last_ms;
-    } else {
-        // likely tick overflow
-        elapsed_ms = current_ms + (UINT32_MAX - last_ms);
-        debug::puts("INFO: Likely tick overflow, OK\r\n");
+    // HIGH priority tasks can set this at any time
+    timeslice::lock();
+    bool on_time = !window_missed;
+    window_missed = false;
+    timeslice::unlock();
+
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        const task_info &task = task_registry[i];
+        if ((task.period != 0) && !task.suspended &&
+                is_due(task.release + task.period, current_ms)) {
+            on_time = false;
+        }
     }
 
-    if (elapsed_ms <= timeslice::LOOP_PERIOD_MS) {
-        // wait out the remaining time in the loop period
-        while ((ms_cnt - last_ms) < timeslice::LOOP_PERIOD_MS) {}
-        current_ms = ms_cnt;
+    if (on_time) {
+        IWDG->KR = IWDG_KEY_RELOAD;
     } else {
-        debug::printf("WARNING: Loop overran by %ums\r\n", elapsed_ms - timeslice::LOOP_PERIOD_MS);
+        missed_windows++;
+        debug::printf("WARNING: Watchdog window missed\r\n");
+    }
+}
+
+/**
+ * @brief Reports the last deadline miss to the debug output, if any were missed since the last call
+ *
+ * Called from the loop, so the print never holds off HIGH priority tasks. However many deadlines
+ * were missed meanwhile, one line is printed.
+ */
+void report_overrun(void)
+{
+    if (unreported_overruns == 0) {
+        return;
+    }
+
+    // HIGH priority tasks can record a miss at any time
+    timeslice::lock();
+    overrun_info overrun = last_overrun;
+    uint32_t count = unreported_overruns;
+    unreported_overruns = 0;
+    timeslice::unlock();
+
+    debug::printf("WARNING: Task %s overran by %ums (took %uus), %u deadline(s) missed\r\n",
+            task_names[overrun.task], overrun.late_ms, overrun.task_cycles/CYCLES_PER_US, count);
+}
+
+/**
+ * @brief Gets the millisecond count the loop must wake up by
+ *
+ * @return earliest of the next LOW priority task deadline and the end of the watchdog window
+ */
+uint32_t next_wakeup(void)
+{
+    uint32_t wakeup = window_end;
+
+    if ((low_queue.len != 0) && is_due(task_registry[low_queue.ids[0]].deadline, wakeup)) {
+        wakeup = task_registry[low_queue.ids[0]].deadline;
+    }
+
+    return wakeup;
+}
+
+/**
+ * @brief Puts a suspended task back in its deadline queue, due right away
+ *
+ * The caller must own the task's queue (e.g. lock out HIGH priority tasks to touch theirs).
+ *
+ * @param[in] id  ID of the task
+ */
+void release_resumed(unsigned id)
+{
+    task_info &task = task_registry[id];
+
+    task.suspended = false;
+    task.release   = ms_cnt;
+    task.deadline  = task.release;
+    queue_insert((task_prios[id] == timeslice::HIGH) ? high_queue : low_queue, id);
+}
+
+/**
+ * @brief Resumes the HIGH priority tasks that IRQ handlers asked to resume
+ *
+ * Only called from the PendSV handler, which owns the HIGH priority queue. A task that isn't
+ * suspended (e.g. it was never waiting) is left as is, the same as `timeslice::resume()`.
+ */
+void take_isr_resumes(void)
+{
+    if (isr_resumes == 0) {
+        return;
+    }
+
+    __disable_irq();
+    uint32_t ids = isr_resumes;
+    isr_resumes = 0;
+    __enable_irq();
+
+    for (unsigned id = 0; ids != 0; ++id, ids >>= 1) {
+        if (((ids & 1u) != 0) && (task_registry[id].period != 0) && task_registry[id].suspended) {
+            release_resumed(id);
+        }
+    }
+}
+
+/**
+ * @brief Runs the task with the earliest deadline in a deadline queue
+ *
+ * The task is removed from the head of the queue, ran, then reinserted with its next deadline.
+ * Any time spent in HIGH priority tasks that preempted it is taken out of its duration.
+ * Releases advance by exactly one period, so tasks do not drift. If the task has missed an entire
+ * period, then the scheduler resynchronizes it to the current time rather than running it
+ * back-to-back to catch up. The task function may be hanging, or the work is too long for it.
+ *
+ * If the task asked to resume at the next tick (e.g. a coroutine that yielded), it is due again in
+ * a millisecond, unless its next release is sooner. This early call doesn't move its releases.
+ *
+ * If the task suspended itself, it is left out of the queue until resumed.
+ *
+ * A missed deadline is only recorded here, and reported later by the loop (see `report_overrun()`).
+ * This may be running in PendSV, where a blocking print would hold off every HIGH priority task
+ * for milliseconds (making them miss deadlines too), and the debug output isn't reentrant.
+ */
+void run_next_task(task_queue &queue)
+{
+    unsigned idx = queue_pop(queue);
+    task_info &task = task_registry[idx];
+
+    // HIGH priority tasks can run in the middle of a LOW priority one, so restore when done
+    unsigned prev_task = running_task;
+    running_task = idx;
+    task.running = true;
+
+    uint32_t start_preempt = preempt_cycles;
+    uint32_t start_cycles  = timeslice::get_cycles();
+    call_task(idx);
+    uint32_t task_cycles = (timeslice::get_cycles() - start_cycles) -
+        (preempt_cycles - start_preempt);
+
+    task.running = false;
+    running_task = prev_task;
+
+    record_duration(task.stats, task_cycles, task_budgets[idx]);
+
+    if (task.suspended) {
+        task.resume_early = false;
+        return;
     }
 
-    last_ms = current_ms;
+    uint32_t current_ms = ms_cnt;
+
+    // only a call at the periodic release moves the release on
+    if (task.deadline == task.release) {
+        task.release += task.period;
+
+        if (is_due(task.release, current_ms)) {
+            task.stats.deadline_misses++;
+            window_missed = true;
+
+            // a LOW priority task's miss can be preempted by a HIGH priority task's
+            timeslice::lock();
+            last_overrun.task        = idx;
+            last_overrun.late_ms     = current_ms - task.release;
+            last_overrun.task_cycles = task_cycles;
+            unreported_overruns++;
+            timeslice::unlock();
+
+            task.release = current_ms + task.period;
+        }
+    }
+
+    task.deadline = task.release;
+    if (task.resume_early) {
+        task.resume_early = false;
+        if (!is_due(current_ms + 1, task.release)) {
+            task.deadline = current_ms + 1;
+        }
+    }
+
+    queue_insert(queue, idx);
 }
 
 }  // namespace
@@ -91,7 +721,8 @@ void manager_task(void)
  * @brief Init TimeSlice loop
  *
  * Enables SysTick timer via CMSIS SysTick_Config (found in arch/core_cm0.h) with required clock
- * cycles to result in 1ms interrupts.
+ * cycles to result in 1ms interrupts. SysTick is set above PendSV, so it can release HIGH priority
+ * tasks while they are running.
  */
 void timeslice::init(void)
 {
@@ -100,36 +731,51 @@ void timeslice::init(void)
         DBG_ASSERT(debug::FORCE_ASSERT);
     }
 
+    NVIC_SetPriority(SysTick_IRQn, SYSTICK_IRQ_PRIO);
+    NVIC_SetPriority(PendSV_IRQn, PENDSV_IRQ_PRIO);
+
     debug::puts("Initialized: TimeSlice\r\n");
 }
 
 /**
  * @brief Register task for timeslice loop
  *
- * If a task can be added, the input task function and period is saved in next open task regsitery
- * slot. Tasks will be executed in order in the task registry.
+ * The task function must be in the BSP's `TASK_TABLE`, which has a registry slot for each task.
+ * Registering saves the task period and phase in that slot, and lets the task run. Tasks of the
+ * same priority that are due at the same time will be executed in the order of the task table.
  *
- * A task is not registerd if the maximum number of tasks have already been registered, the task
- * function is invalid, or if the task period is 0, less than the loop period, and/or not a multiple
- * of the loop period.
+ * The phase is how long after the loop starts the task is first ran. If it is
+ * `timeslice::AUTO_PHASE`, a phase is picked when the loop starts that avoids the other tasks.
+ *
+ * A task is not registerd if the task function is not in the task table, the task has already been
+ * registered, the task period is 0, or the phase isn't less than the period.
  *
  * @param[in] period     task period, in millisecond
  * @param[in] task_func  task function to be called at task period
+ * @param[in] phase      offset of the task's first call, in milliseconds (or AUTO_PHASE)
  *
  * @return timeslice::SUCCESS if the task has been registered
  *         timeslice::FAILURE if the task has not been registered
  */
-timeslice::RegStatus timeslice::register_task(unsigned period, void (*task_func)(void))
+timeslice::RegStatus timeslice::register_task(unsigned period, void (*task_func)(void),
+        unsigned phase)
 {
-    if (((period % timeslice::LOOP_PERIOD_MS) != 0) || ((period / timeslice::LOOP_PERIOD_MS) == 0)
-            || ((task_func == nullptr) || (ntasks >= timeslice::MAX_NUM_TASKS))) {
+    unsigned id = find_task(task_func);
+
+    if ((period == 0) || (id >= NUM_TASKS) || (task_registry[id].period != 0) ||
+            ((phase != timeslice::AUTO_PHASE) && (phase >= period))) {
         return timeslice::FAILURE;
     }
 
-    // populate next task registry slot
-    task_registry[ntasks].loops_per_period = period / timeslice::LOOP_PERIOD_MS;
-    task_registry[ntasks].loop_cnt         = 0;
-    task_registry[ntasks].task_func        = task_func;
+    // populate the task's registry slot
+    task_registry[id].period   = period;
+    task_registry[id].phase    = phase;
+    task_registry[id].deadline = 0;
+    task_registry[id].release  = 0;
+    task_registry[id].resume_early = false;
+    task_registry[id].suspended    = false;
+    task_registry[id].running      = false;
+    clear_stats(task_registry[id].stats);
 
     ntasks++;
 
@@ -142,38 +788,389 @@ timeslice::RegStatus timeslice::register_task(unsigned period, void (*task_func)
  * This should be called ONLY when all initialization has been completed. There should be no return
  * from this fuction.
  *
- * The manager task ensures that each task loop counter is increased every loop period. When the
- * task loop counter reaches the required value to achieve the desired task period, it will execute
- * the task function and start counting again.
+ * Every task is first due its phase after the loop starts. HIGH priority tasks are handed off to
+ * PendSV. Each time through, the loop dispatches any posted events, services the watchdog, and
+ * reports any missed deadlines, then runs the LOW priority task at the head of its deadline queue
+ * if it is due, otherwise sleeps until it is (or until an event is posted, or the watchdog window
+ * ends).
  */
 void timeslice::enter_loop(void)
 {
     debug::puts("Starting timeslice loop...\r\n");
 
+    if (ntasks == 0) {
+        while (1) {}
+    }
+
+    place_phases();
+
     // any amount of time could have passed since initialization
-    last_ms = ms_cnt;
+    __disable_irq();
+    uint32_t start_ms = ms_cnt;
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        if (task_registry[i].period != 0) {
+            task_registry[i].release  = start_ms + task_registry[i].phase;
+            task_registry[i].deadline = task_registry[i].release;
+            queue_insert((task_prios[i] == timeslice::HIGH) ? high_queue : low_queue, i);
+        }
+    }
+    if (high_queue.len != 0) {
+        high_deadline = task_registry[high_queue.ids[0]].deadline;
+    }
+
+    // a HIGH priority task with phase 0 is already due, and can't wait on the next tick to be ran
+    if (head_is_due(high_queue)) {
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+    __enable_irq();
+
+    window_end = start_ms + WDT_WINDOW_MS;
+    if (timeslice::WATCHDOG_ENABLED) {
+        start_watchdog();
+    }
+
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        if (task_registry[i].period != 0) {
+            debug::printf("Task %s: %s priority, period %ums, phase %ums\r\n", task_names[i],
+                    (task_prios[i] == timeslice::HIGH) ? "HIGH" : "LOW", task_registry[i].period,
+                    task_registry[i].phase);
+        }
+    }
 
     while (1) {
-        manager_task();
+        event::dispatch();
+        service_watchdog();
+        report_overrun();
 
-        // handle each task counter, and call task function if desired # of loops reached
-        for (unsigned i = 0; i < ntasks; ++i) {
-            if (task_registry[i].loop_cnt >= task_registry[i].loops_per_period) {
-                task_registry[i].loop_cnt = 0;
-                task_registry[i].task_func();
-            }
-            task_registry[i].loop_cnt++;
+        if (head_is_due(low_queue)) {
+            run_next_task(low_queue);
+        } else {
+            sleep_until(next_wakeup());
+        }
+    }
+}
+
+/**
+ * @brief Have the running task called again at the next tick
+ *
+ * Meant for a task that yielded partway through some long work (see `CO_YIELD()`), so it can carry
+ * on in a millisecond rather than waiting for its next period. The early call doesn't change when
+ * its periodic calls happen. Does nothing if called outside of a task.
+ */
+void timeslice::resume_next_tick(void)
+{
+    if (running_task < NUM_TASKS) {
+        task_registry[running_task].resume_early = true;
+    }
+}
+
+/**
+ * @brief Suspend the running task
+ *
+ * Once the running task returns, it isn't called again until `timeslice::resume()`. Meant for a
+ * task that has nothing to do until an interrupt, which can then post an event to have it resumed.
+ * Does nothing if called outside of a task.
+ */
+void timeslice::suspend(void)
+{
+    if (running_task < NUM_TASKS) {
+        task_registry[running_task].suspended = true;
+    }
+}
+
+/**
+ * @brief Resume a suspended task
+ *
+ * The task is due right away, and its period carries on from now. A HIGH priority task preempts
+ * the caller (once any lock is released). Must only be called from the loop (e.g. an event handler)
+ * or from a task, as the deadline queues are not touched by IRQ handlers.
+ *
+ * @param[in] task_func  task function the task was registered with
+ *
+ * @return timeslice::SUCCESS if the task was suspended, and is now resumed
+ *         timeslice::FAILURE if the task is not registered, or not suspended
+ */
+timeslice::RegStatus timeslice::resume(void (*task_func)(void))
+{
+    unsigned id = find_task(task_func);
+    if ((id >= NUM_TASKS) || (task_registry[id].period == 0) || !task_registry[id].suspended) {
+        return timeslice::FAILURE;
+    }
+
+    task_info &task = task_registry[id];
+
+    // the task may not have returned since suspending, in which case it is queued once it does
+    if (task.running) {
+        task.suspended = false;
+        return timeslice::SUCCESS;
+    }
+
+    // PendSV owns the HIGH priority queue, so hold it off while inserting
+    timeslice::lock();
+    release_resumed(id);
+    if (task_prios[id] == timeslice::HIGH) {
+        high_deadline   = task_registry[high_queue.ids[0]].deadline;
+        pendsv_deferred = true;
+    }
+    timeslice::unlock();
+
+    return timeslice::SUCCESS;
+}
+
+/**
+ * @brief Resume a suspended HIGH priority task from an IRQ handler
+ *
+ * The deadline queues can't be touched from an IRQ handler, so the task is marked, and PendSV is
+ * pended to take it (right after the IRQ handler returns, unless HIGH priority tasks are locked
+ * out). Nothing can be dropped, and the task doesn't wait on the loop (or the LOW priority task it
+ * is running) to dispatch an event. If the task suspends itself after being marked, it is still
+ * resumed, so a task can check for work, suspend, and not miss an IRQ in between.
+ *
+ * @param[in] task_func  task function the task was registered with
+ *
+ * @return timeslice::SUCCESS if the task will be resumed (if suspended)
+ *         timeslice::FAILURE if the task is not in the task table, or isn't HIGH priority
+ */
+timeslice::RegStatus timeslice::resume_from_isr(void (*task_func)(void))
+{
+    unsigned id = find_task(task_func);
+    if ((id >= NUM_TASKS) || (task_prios[id] != timeslice::HIGH)) {
+        return timeslice::FAILURE;
+    }
+
+    // IRQ handlers of other priorities may be marking tasks too
+    __disable_irq();
+    isr_resumes = isr_resumes | (1u << id);
+    __enable_irq();
+
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+
+    return timeslice::SUCCESS;
+}
+
+/**
+ * @brief Change the period of a registered task
+ *
+ * Meant for tasks that need to run more often at some times than others (e.g. scanning fast only
+ * while keys are in use). If called by the task itself, the release after this call is one new
+ * period after the current one. Otherwise the task's next release (already queued) is kept, and
+ * the releases after it are a new period apart.
+ *
+ * @param[in] task_func  task function the task was registered with
+ * @param[in] period     new task period, in milliseconds
+ *
+ * @return timeslice::SUCCESS if the period was changed
+ *         timeslice::FAILURE if the task is not registered, or the period is 0
+ */
+timeslice::RegStatus timeslice::set_period(void (*task_func)(void), unsigned period)
+{
+    unsigned id = find_task(task_func);
+    if ((period == 0) || (id >= NUM_TASKS) || (task_registry[id].period == 0)) {
+        return timeslice::FAILURE;
+    }
+
+    // PendSV moves the releases of HIGH priority tasks on by their period
+    timeslice::lock();
+    task_registry[id].period = period;
+    timeslice::unlock();
+
+    return timeslice::SUCCESS;
+}
+
+/**
+ * @brief Get the current millisecond count
+ *
+ * @return milliseconds elapsed since the SysTick was started
+ */
+uint32_t timeslice::get_ms(void)
+{
+    return ms_cnt;
+}
+
+/**
+ * @brief Lock out HIGH priority tasks
+ *
+ * While locked, HIGH priority tasks that become due are held off until the matching unlock, so data
+ * shared with them can be accessed without being preempted. Locks nest, and only the outermost
+ * unlock releases them. Interrupts are not affected.
+ */
+void timeslice::lock(void)
+{
+    lock_depth++;
+}
+
+/**
+ * @brief Release a lock on HIGH priority tasks
+ *
+ * If any HIGH priority task became due while locked, it is ran as soon as the last lock is
+ * released.
+ */
+void timeslice::unlock(void)
+{
+    DBG_ASSERT(lock_depth != 0);
+
+    lock_depth--;
+    if ((lock_depth == 0) && pendsv_deferred) {
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+}
+
+/**
+ * @brief Get the current time in clock cycles
+ *
+ * The SysTick counts down from `CYCLES_PER_MS - 1` every millisecond, so the cycles into the
+ * current millisecond is added onto the millisecond count. If the SysTick has reloaded but its
+ * interrupt hasn't been taken yet (pending, or we are masking it), the millisecond count is one
+ * behind, so it gets corrected here.
+ *
+ * @return current time, in clock cycles
+ */
+uint32_t timeslice::get_cycles(void)
+{
+    uint32_t ms, val;
+    bool pending;
+
+    do {
+        ms      = ms_cnt;
+        val     = SysTick->VAL;
+        pending = (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) != 0;
+    } while (ms != ms_cnt);
+
+    if (pending && (val > (CYCLES_PER_MS/2))) {
+        ms++;
+    }
+
+    return ms*CYCLES_PER_MS + ((CYCLES_PER_MS - 1) - val);
+}
+
+/**
+ * @brief Get the execution statistics of a registered task
+ *
+ * @param[in]  task_func  task function the task was registered with
+ * @param[out] stats      filled with the task's statistics
+ *
+ * @return timeslice::SUCCESS if the task was found
+ *         timeslice::FAILURE if the task is not registered
+ */
+timeslice::RegStatus timeslice::get_task_stats(void (*task_func)(void), timeslice::TaskStats &stats)
+{
+    unsigned id = find_task(task_func);
+    if ((id >= NUM_TASKS) || (task_registry[id].period == 0)) {
+        return timeslice::FAILURE;
+    }
+
+    const task_stats &tstats = task_registry[id].stats;
+
+    stats.calls       = tstats.calls;
+    stats.min_cycles  = (tstats.calls == 0) ? 0 : tstats.min_cycles;
+    stats.max_cycles  = tstats.max_cycles;
+    stats.mean_cycles = (tstats.calls == 0) ? 0 :
+        static_cast<uint32_t>(tstats.total_cycles/tstats.calls);
+    for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+        stats.hist[i] = tstats.hist[i];
+    }
+    stats.budget_us       = task_budgets[id]/CYCLES_PER_US;
+    stats.budget_misses   = tstats.budget_misses;
+    stats.deadline_misses = tstats.deadline_misses;
+
+    return timeslice::SUCCESS;
+}
+
+/**
+ * @brief Clear the execution statistics of all tasks
+ */
+void timeslice::reset_task_stats(void)
+{
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        clear_stats(task_registry[i].stats);
+    }
+}
+
+/**
+ * @brief Print the execution statistics of all tasks
+ *
+ * Durations are printed in microseconds. The histogram is printed as the count in each bucket,
+ * starting with bucket 0.
+ */
+void timeslice::print_task_stats(void)
+{
+    timeslice::TaskStats stats;
+
+    for (unsigned i = 0; i < NUM_TASKS; ++i) {
+        if (timeslice::get_task_stats(task_funcs[i], stats) != timeslice::SUCCESS) {
+            continue;
         }
+
+        debug::printf("Task %s: calls %u, min %uus, max %uus, mean %uus\r\n",
+                task_names[i], stats.calls, stats.min_cycles/CYCLES_PER_US,
+                stats.max_cycles/CYCLES_PER_US, stats.mean_cycles/CYCLES_PER_US);
+        debug::printf("    budget %uus, over budget %u, missed deadlines %u\r\n    hist:",
+                stats.budget_us, stats.budget_misses, stats.deadline_misses);
+        for (unsigned j = 0; j < HIST_BUCKETS; ++j) {
+            debug::printf(" %u", stats.hist[j]);
+        }
+        debug::puts("\r\n");
     }
+
+    debug::printf("Watchdog windows missed: %u\r\n", missed_windows);
+}
+
+/**
+ * @brief Get the number of watchdog windows missed
+ *
+ * @return number of watchdog windows that ended without the watchdog being refreshed
+ */
+uint32_t timeslice::get_missed_windows(void)
+{
+    return missed_windows;
 }
 
 /**
 * @brief SysTick IRQ Handler
 *
 * When initalized, the SysTick will generate interrupts at 1kHz. This IRQ handler will then
-* increment the TimeSlice millisecond count every entrance.
+* increment the TimeSlice millisecond count every entrance. If a HIGH priority task is due, PendSV
+* is pended to run it. Once the programmed wakeup deadline is reached, the loop is allowed to resume
+* on exit.
 */
 void SysTick_Handler(void)
 {
     ms_cnt++;
+
+    if ((high_queue.len != 0) && is_due(high_deadline, ms_cnt)) {
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+
+    if (is_due(wakeup_ms, ms_cnt)) {
+        bitop::clr_msk(SCB->SCR, SCB_SCR_SLEEPONEXIT_Msk);
+    }
+}
+
+/**
+* @brief PendSV Handler
+*
+* Runs every HIGH priority task that is due (or resumed by an IRQ handler), preempting whatever LOW
+* priority task the loop is running. If HIGH priority tasks are locked out, nothing is ran, and PendSV is pended again on
+* unlock. The time spent here is tracked, so it can be taken out of the preempted task's duration.
+*/
+void PendSV_Handler(void)
+{
+    if (lock_depth != 0) {
+        pendsv_deferred = true;
+        return;
+    }
+    pendsv_deferred = false;
+
+    uint32_t start_cycles = timeslice::get_cycles();
+
+    take_isr_resumes();
+    while (head_is_due(high_queue)) {
+        run_next_task(high_queue);
+        take_isr_resumes();
+    }
+    if (high_queue.len != 0) {
+        high_deadline = task_registry[high_queue.ids[0]].deadline;
+    }
+
+    preempt_cycles += timeslice::get_cycles() - start_cycles;
 }
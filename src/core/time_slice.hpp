@@ -6,12 +6,25 @@
  * @date      2020/10/12
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
- * Core time slice loop scheduler, which will use the SysTick timer to execute a loop at a set
- * LOOP_PERIOD_MS period. It will count these loops to execute given tasks at a specified period.
- * This gives program execution a concept of timing periodicity.
+ * Core time slice loop scheduler, which will use the SysTick timer to count milliseconds. Each
+ * registered task has a deadline (the millisecond count at which it is next due), and the tasks
+ * are kept in a queue ordered by deadline. The loop runs every task that is due, then sleeps until
+ * the earliest deadline. This gives program execution a concept of timing periodicity, without
+ * quantizing task periods to a loop period.
  *
- * If the loop manager detects an overrun of the loop period, it will complain, but will continue
- * the loop as normal.
+ * Tasks are either HIGH or LOW priority, set in the BSP's `TASK_TABLE`. HIGH priority tasks are ran
+ * from the PendSV exception, and preempt the LOW priority tasks ran cooperatively by the loop. So
+ * latency critical tasks (e.g. key scanning and HID reports) don't wait on slow background work.
+ *
+ * Each task is first ran its phase after the loop starts. If not given, phases are picked so tasks
+ * are released in different milliseconds whenever possible.
+ *
+ * If the loop manager detects a task has missed an entire period, it will complain, but will
+ * continue the loop as normal. Deadline misses and calls over each task's time budget are counted,
+ * and the IWDG watchdog resets the MCU if tasks keep missing deadlines (e.g. a task hangs).
+ *
+ * Every task call is timed in SysTick clock cycles (1/SYSCLK), and per-task execution statistics
+ * can be queried at runtime to find which tasks are eating up the time.
  *
  * The SysTick timer shall not be used for anything else...
  */
@@ -19,19 +32,48 @@
 #ifndef CORE_TIME_SLICE_HPP_
 #define CORE_TIME_SLICE_HPP_
 
+#include <cstdint>
+
 /**
  * @brief Timeslice scheduler namespace
  *
  * This namespace holds initialization routines for the timeslice scheduler, which handles calling
- * tasks at a certain period. Tasks must be registered to be ran via the timeslice loop.
+ * tasks at a certain period. The tasks that can be ran are set at compile time by the BSP's
+ * `TASK_TABLE`, and each must be registered to be ran via the timeslice loop.
  */
 namespace timeslice {
 
-/// Period at which the loop will execute (in milliseconds). try to make as large as possible
-constexpr unsigned LOOP_PERIOD_MS = 5;
+/// If set, the core sleeps (WFI) until the next deadline. else it spins (e.g. for some debuggers)
+constexpr bool SLEEP_WHEN_IDLE = true;
+
+/// If set, the IWDG watchdog resets the MCU if tasks stop meeting their deadlines
+constexpr bool WATCHDOG_ENABLED = true;
+
+/// Phase given at registration to have the scheduler pick one that avoids the other tasks
+constexpr unsigned AUTO_PHASE = ~0u;
+
+/// Number of buckets in each task's execution time histogram
+constexpr unsigned HIST_BUCKETS = 14;
+
+/// Histogram bucket 0 holds durations < 2^(HIST_BASE_LOG2 + 1) cycles, each bucket after doubles
+constexpr unsigned HIST_BASE_LOG2 = 6;
+
+/// Task priority classes, set for each task in the BSP's `TASK_TABLE`
+enum Priority {
+    LOW,   ///< background task, ran cooperatively by the timeslice loop
+    HIGH,  ///< latency critical task, ran from PendSV and preempts LOW priority tasks
+};
+
+/// Coroutine return values
+enum CoStatus {
+    CO_YIELDED,  ///< coroutine yielded, and must be called again to carry on
+    CO_DONE,     ///< coroutine ran to its end (or exited), next call starts it over
+};
 
-/// Maximum number of tasks that can be registerd. try to make as small as possible
-constexpr unsigned MAX_NUM_TASKS  = 4;
+/// Resume point of a coroutine. must outlive the coroutine (e.g. static), and start zeroed
+struct Coroutine {
+    unsigned resume;
+};
 
 /// Return status values
 enum RegStatus {
@@ -39,15 +81,118 @@ enum RegStatus {
     FAILURE,
 };
 
+/// Execution statistics for a task, durations in clock cycles (see `clock::SYSCLK_HZ`) unless noted
+struct TaskStats {
+    uint32_t calls;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint32_t mean_cycles;
+    uint32_t hist[HIST_BUCKETS];
+    uint32_t budget_us;
+    uint32_t budget_misses;
+    uint32_t deadline_misses;
+};
+
 /// Init SysTick timer for counting milliseconds for the TimeSlice scheduler
 void init(void);
 
-/// Register a task with the scheduler (must not be at maximum # of tasks, see `MAX_NUM_TASKS`)
-RegStatus register_task(unsigned period, void (*task_func)(void));
+/// Register a task with the scheduler (must be in the BSP's `TASK_TABLE`)
+RegStatus register_task(unsigned period, void (*task_func)(void), unsigned phase = AUTO_PHASE);
+
+/// Change the period of a registered task. The task's next release is one new period after its last
+RegStatus set_period(void (*task_func)(void), unsigned period);
 
 /// Enter timeslice loop and start scheduler. Never returns...
 void enter_loop(void);
 
+/// Hold off HIGH priority tasks while accessing data shared with them. Nestable
+void lock(void);
+
+/// Release a lock(). Each lock() must be matched by exactly one unlock()
+void unlock(void);
+
+/// Have the task that is running be called again at the next tick, without moving its period
+void resume_next_tick(void);
+
+/// Stop calling the task that is running, until it is resumed (e.g. it waits on an interrupt)
+void suspend(void);
+
+/// Make a suspended task due right away. Only from the loop or a task, see `resume_from_isr()`
+RegStatus resume(void (*task_func)(void));
+
+/// Make a suspended HIGH priority task due right away, from an IRQ handler
+RegStatus resume_from_isr(void (*task_func)(void));
+
+/// Get the number of milliseconds since the scheduler started. Wraps around every ~49 days
+uint32_t get_ms(void);
+
+/// Get the current time, in clock cycles. Wraps around every 2^32 cycles
+uint32_t get_cycles(void);
+
+/// Get the execution statistics of a registered task
+RegStatus get_task_stats(void (*task_func)(void), TaskStats &stats);
+
+/// Clear the execution statistics of all tasks
+void reset_task_stats(void);
+
+/// Print the execution statistics of all tasks to the debug output
+void print_task_stats(void);
+
+/// Get the number of watchdog windows that ended without the watchdog being refreshed
+uint32_t get_missed_windows(void);
+
 }  // namespace timeslice
 
+/**
+ * Stackless coroutines (protothreads), so long work can be split across several task calls.
+ *
+ * A coroutine is a function returning timeslice::CoStatus, with its body between CO_BEGIN() and
+ * CO_END(). It can CO_YIELD() back to its caller, and the next call resumes right after the yield.
+ * This is done with a switch on the line number of the yield, so a coroutine costs one word of RAM
+ * rather than a stack. As such, local variables are NOT kept across a yield (keep them static),
+ * and a yield can't be inside a switch statement of its own.
+ *
+ * A task driving a coroutine would typically call `timeslice::resume_next_tick()` if it yielded.
+ */
+
+/// Start of a coroutine body. jumps to where the coroutine last yielded
+#define CO_BEGIN(co)                          \
+    switch ((co).resume) {                    \
+        case 0:
+
+/// Yield to the caller. the next call carries on from here
+#define CO_YIELD(co)                          \
+    do {                                      \
+        (co).resume = __LINE__;               \
+        return timeslice::CO_YIELDED;         \
+        case __LINE__:;                       \
+    } while (0)
+
+/// Yield to the caller until the condition is true
+#define CO_WAIT_UNTIL(co, cond)               \
+    do {                                      \
+        (co).resume = __LINE__;               \
+        [[fallthrough]];                      \
+        case __LINE__:                        \
+        if (!(cond)) {                        \
+            return timeslice::CO_YIELDED;     \
+        }                                     \
+    } while (0)
+
+/// End the coroutine early. the next call starts it over
+#define CO_EXIT(co)                           \
+    do {                                      \
+        (co).resume = 0;                      \
+        return timeslice::CO_DONE;            \
+    } while (0)
+
+/// End of a coroutine body. the next call starts it over
+#define CO_END(co)                            \
+    }                                         \
+    (co).resume = 0;                          \
+    return timeslice::CO_DONE
+
+/// Check if a coroutine is partway through (has yielded, and not yet ended)
+#define CO_IS_RUNNING(co) ((co).resume != 0)
+
 #endif  // CORE_TIME_SLICE_HPP_
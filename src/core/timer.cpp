@@ -0,0 +1,65 @@
+/**
+ * @file      timer.cpp
+ * @brief     Microsecond timestamps and delays
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * TIM2 is clocked from PCLK (= SYSCLK, APB1 is not divided), and prescaled down to 1MHz. It counts
+ * up over the full 32-bit range, and never interrupts.
+ */
+
+#include "core/timer.hpp"
+
+#include <cstdint>
+
+#include "core/clock.hpp"
+#include "util/bitop.hpp"
+#include "util/debug.hpp"
+#include "stm32f0xx.h"  // NOLINT
+
+namespace {
+
+/// Frequency TIM2 counts at
+constexpr uint32_t TIMER_HZ = 1000000;
+
+}  // namespace
+
+/**
+ * @brief Init microsecond counter
+ *
+ * The prescaler is only loaded on an update event, so one is generated before the counter is
+ * started. Must be called after the system clock is initialized.
+ */
+void timer::init(void)
+{
+    // enable clock to TIM2 peripheral
+    bitop::set_msk(RCC->APB1ENR, RCC_APB1ENR_TIM2EN);
+
+    // count up at 1MHz, over the full 32-bit range
+    TIM2->PSC = (clock::SYSCLK_HZ/TIMER_HZ) - 1;
+    TIM2->ARR = UINT32_MAX;
+
+    // load the prescaler, then start counting from 0
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->CNT = 0;
+    bitop::set_msk(TIM2->CR1, TIM_CR1_CEN);
+
+    debug::puts("Initialized: Timer\r\n");
+}
+
+/**
+ * @brief Busy-wait for at least the given number of microseconds
+ *
+ * The first count may be partway through, so one extra count is waited for. The delay is
+ * therefore between `us` and `us + 1` microseconds (plus however long any interrupts take).
+ *
+ * @param[in] us  number of microseconds to wait
+ */
+void timer::delay_us(uint32_t us)
+{
+    uint32_t start_us = timer::now_us();
+
+    while ((timer::now_us() - start_us) <= us) {}
+}
@@ -0,0 +1,54 @@
+/**
+ * @file      timer.hpp
+ * @brief     Microsecond timestamps and delays
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * TIM2 (the only 32-bit timer) is prescaled to count microseconds, and left free running. This
+ * gives a microsecond timestamp that wraps around every ~71 minutes, and calibrated busy-wait
+ * delays that don't depend on optimization level or flash wait states.
+ *
+ * TIM2 shall not be used for anything else...
+ */
+
+#ifndef CORE_TIMER_HPP_
+#define CORE_TIMER_HPP_
+
+#include <cstdint>
+
+#include "stm32f0xx.h"  // NOLINT
+
+/**
+ * @brief Timer namespace
+ *
+ * Holds the microsecond timestamp and delay API.
+ */
+namespace timer {
+
+/// Init TIM2 as a free running microsecond counter
+void init(void);
+
+/// Get the current time, in microseconds. Wraps around every 2^32 microseconds
+inline uint32_t now_us(void);
+
+/// Busy-wait for at least the given number of microseconds
+void delay_us(uint32_t us);
+
+}  // namespace timer
+
+/**
+ * @brief Get the current time in microseconds
+ *
+ * Differences between two timestamps are correct across wrap around, as long as they are taken as
+ * unsigned and are less than 2^32 microseconds apart.
+ *
+ * @return current time, in microseconds
+ */
+inline uint32_t timer::now_us(void)
+{
+    return TIM2->CNT;
+}
+
+#endif  // CORE_TIMER_HPP_
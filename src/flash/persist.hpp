@@ -7,8 +7,8 @@
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
  * Two pages of flash memory in the STM32F042 are used to hold data that is desired to persist
- * between power cycles (for instance, the coloring profile). The ST EEPROM emulator driver is used
- * to perform reads and writes to flash.
+ * between power cycles (for instance, the coloring profile, or remapped keys). The ST EEPROM
+ * emulator driver is used to perform reads and writes to flash.
  *
  * Each data word is of type uint16_t.
  *
@@ -33,7 +33,23 @@
     ENTRY(SPEED_IDX,   0x0006) \
     ENTRY(RED_IDX,     0x0007) \
     ENTRY(GREEN_IDX,   0x0008) \
-    ENTRY(BLUE_IDX,    0x0009)
+    ENTRY(BLUE_IDX,    0x0009) \
+    ENTRY(REMAP0_KEY,  0x0100) ENTRY(REMAP0_CODE,  0x0101) \
+    ENTRY(REMAP1_KEY,  0x0102) ENTRY(REMAP1_CODE,  0x0103) \
+    ENTRY(REMAP2_KEY,  0x0104) ENTRY(REMAP2_CODE,  0x0105) \
+    ENTRY(REMAP3_KEY,  0x0106) ENTRY(REMAP3_CODE,  0x0107) \
+    ENTRY(REMAP4_KEY,  0x0108) ENTRY(REMAP4_CODE,  0x0109) \
+    ENTRY(REMAP5_KEY,  0x010A) ENTRY(REMAP5_CODE,  0x010B) \
+    ENTRY(REMAP6_KEY,  0x010C) ENTRY(REMAP6_CODE,  0x010D) \
+    ENTRY(REMAP7_KEY,  0x010E) ENTRY(REMAP7_CODE,  0x010F) \
+    ENTRY(REMAP8_KEY,  0x0110) ENTRY(REMAP8_CODE,  0x0111) \
+    ENTRY(REMAP9_KEY,  0x0112) ENTRY(REMAP9_CODE,  0x0113) \
+    ENTRY(REMAP10_KEY, 0x0114) ENTRY(REMAP10_CODE, 0x0115) \
+    ENTRY(REMAP11_KEY, 0x0116) ENTRY(REMAP11_CODE, 0x0117) \
+    ENTRY(REMAP12_KEY, 0x0118) ENTRY(REMAP12_CODE, 0x0119) \
+    ENTRY(REMAP13_KEY, 0x011A) ENTRY(REMAP13_CODE, 0x011B) \
+    ENTRY(REMAP14_KEY, 0x011C) ENTRY(REMAP14_CODE, 0x011D) \
+    ENTRY(REMAP15_KEY, 0x011E) ENTRY(REMAP15_CODE, 0x011F)
 
 /**
  * @brief Persist data management namespace
@@ -50,6 +66,11 @@ enum DataId : uint16_t {
 #undef ENTRY
 };
 
+/// Number of remapped key slots, each a key word (layer << 8 | key index) and a keycode word
+constexpr unsigned REMAP_SLOTS = 16;
+
+static_assert(REMAP15_CODE == (REMAP0_KEY + 2*REMAP_SLOTS - 1), "Remap slots must be contiguous");
+
 /// Status of the data read/write
 enum Status {
     FLASH_ERROR,
@@ -91,7 +112,7 @@ inline void persist::read_or_create_data(persist::DataId id, uint16_t &buf, uint
         buf = default_val;
         if (pstat == persist::NONEXISTENT_DATA) {
             // the data doesn't exist in flash: either first time, or it got erased
-            persist::write_data(persist::PROFILE_IDX, buf);
+            persist::write_data(id, buf);
         }
     }
 }
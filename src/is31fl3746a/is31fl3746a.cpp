@@ -17,6 +17,9 @@
  *
  * There are 64 input PWM steps, which are then converted to a gamma corrected value.
  *
+ * Setting the color or brightness doesn't write the PWM registers right away. A whole write of
+ * them takes ~5ms at 100kHz SCL, so it is done by the `is31fl3746a::update()` coroutine instead,
+ * one chunk of LEDs per call.
  */
 
 #include "is31fl3746a/is31fl3746a.hpp"
@@ -25,6 +28,7 @@
 
 #include "bsp/bsp.hpp"
 #include "comm/i2c.hpp"
+#include "core/time_slice.hpp"
 #include "is31fl3746a/is31fl3746a_regs.hpp"
 #include "util/debug.hpp"
 #include "util/expressions.hpp"
@@ -57,6 +61,12 @@ constexpr int NUM_GAMMA_STEPS = COUNT_OF(GAMMA_STEP_LUT);
 /// number of LEDs (18 RGBs)
 constexpr int NUM_LEDS = 54;
 
+/// number of LEDs written per update() call (6 RGBs, ~1.7ms at 100kHz SCL)
+constexpr int PWM_CHUNK_LEDS = 18;
+
+static_assert((NUM_LEDS % PWM_CHUNK_LEDS) == 0, "PWM chunks must be whole");
+static_assert((PWM_CHUNK_LEDS % 3) == 0, "PWM chunks must be whole RGBs");
+
 /// used to hold gamma corrected pwm values
 typedef struct {
     uint8_t red;
@@ -73,12 +83,23 @@ uint8_t brightness = 0;
 /// save the color value for entire board, needed for brightness setting
 uint32_t color = 0;
 
+/// the color or brightness changed since the PWM registers were last written
+bool pwm_dirty = false;
+
+/// register page last selected, so it is only written when it changes
+uint8_t current_page = 0xFF;
+
+/// resume point of the update() coroutine
+timeslice::Coroutine update_co = { };
+
 /**
  * @brief Sets is32fl3746a register page
  *
  * Page 0 contains the PWM registers for each LED. Page 1 contains scale registers for each LED, and
  * several configuration registers.
  *
+ * The selected page is kept track of, so nothing is written if it is already selected.
+ *
  * @ param[in] page  PAGE_0 or PAGE_1
  */
 void set_page(uint8_t page)
@@ -88,6 +109,11 @@ void set_page(uint8_t page)
         return;
     }
 
+    if (page == current_page) {
+        return;
+    }
+    current_page = page;
+
     uint8_t buf[2];
 
     // first unlock the page select register
@@ -102,7 +128,7 @@ void set_page(uint8_t page)
 }
 
 /**
- * @brief Sets PWM values for all 36 RGB
+ * @brief Calculates the PWM values for the current color and brightness
  *
  * Each LED has individual PWM control. The value depends on both the brightness, and the color.
  * The non-gamma-scaled value is scaled up and down for EVERY LED based on the brightness. This
@@ -116,26 +142,39 @@ void set_page(uint8_t page)
  * resultant non-gamma-scaled value would be 16. This number will then be used to index into the
  * gamma corrected value LUT to reach a value of 24. If the brightness was then incresed to 48,
  * then the non-gamma-scaled value would be scaled to 24, and corrected value of 47.
+ *
+ * @param[out] pwm  filled with the red, green, and blue PWM values
  */
-void set_pwm(void)
+void calc_pwm(PWMValues &pwm)
 {
-    uint8_t idx, rpwm, gpwm, bpwm;
-    idx  = DIVIDE_ROUND<uint16_t>(R_RGB(color)*brightness, 255);
-    rpwm = GAMMA_STEP_LUT[idx];
+    uint8_t idx;
+    idx       = DIVIDE_ROUND<uint16_t>(R_RGB(color)*brightness, 255);
+    pwm.red   = GAMMA_STEP_LUT[idx];
 
-    idx  = DIVIDE_ROUND<uint16_t>(G_RGB(color)*brightness, 255);
-    gpwm = GAMMA_STEP_LUT[idx];
+    idx       = DIVIDE_ROUND<uint16_t>(G_RGB(color)*brightness, 255);
+    pwm.green = GAMMA_STEP_LUT[idx];
 
-    idx  = DIVIDE_ROUND<uint16_t>(B_RGB(color)*brightness, 255);
-    bpwm = GAMMA_STEP_LUT[idx];
+    idx       = DIVIDE_ROUND<uint16_t>(B_RGB(color)*brightness, 255);
+    pwm.blue  = GAMMA_STEP_LUT[idx];
+}
 
-    // set all pwm registers
-    uint8_t buf[NUM_LEDS + 1];
-    buf[0] = is31fl3746a::reg::LED_PWM_START_R;
-    for (int i = 1; i < (NUM_LEDS + 1); i += 3) {
-        buf[i]     = rpwm;
-        buf[i + 1] = gpwm;
-        buf[i + 2] = bpwm;
+/**
+ * @brief Writes the PWM registers of one chunk of LEDs
+ *
+ * The device auto-increments the write address, so a chunk is written starting at its first PWM
+ * register.
+ *
+ * @param[in] first_led  first LED of the chunk
+ * @param[in] pwm        red, green, and blue PWM values to write
+ */
+void write_pwm_chunk(int first_led, const PWMValues &pwm)
+{
+    uint8_t buf[PWM_CHUNK_LEDS + 1];
+    buf[0] = is31fl3746a::reg::LED_PWM_START_R + first_led;
+    for (int i = 1; i < (PWM_CHUNK_LEDS + 1); i += 3) {
+        buf[i]     = pwm.red;
+        buf[i + 1] = pwm.green;
+        buf[i + 2] = pwm.blue;
     }
     set_page(is31fl3746a::reg::PAGE_0);
     rgb_i2c.write_blocking(buf, sizeof(buf));
@@ -200,28 +239,75 @@ void is31fl3746a::init(void)
  * @brief Sets color for ALL RGB LEDs
  *
  * The input RGB code will be used (along with the current brightness) to calculate corresponding
- * PWM value.
+ * PWM value. The LEDs change once `is31fl3746a::update()` has written it.
  *
  * @param[in] rgb_code  RGB hex code to set
  */
 void is31fl3746a::set_color(uint32_t rgb_code)
 {
-    color = rgb_code;
-    set_pwm();
+    if (rgb_code != color) {
+        color     = rgb_code;
+        pwm_dirty = true;
+    }
 }
 
 /**
  * @brief Sets brightness for ALL RGB LEDs
  *
  * The input brightness value will be used (along with the current color) to calculate
- * corresponding PWM value.
+ * corresponding PWM value. The LEDs change once `is31fl3746a::update()` has written it.
  *
  * @param[in] val  brightness value [0 - 63]
  */
 void is31fl3746a::set_brightness(uint8_t val)
 {
-    brightness = val % NUM_GAMMA_STEPS;
-    set_pwm();
+    val %= NUM_GAMMA_STEPS;
+    if (val != brightness) {
+        brightness = val;
+        pwm_dirty  = true;
+    }
+}
+
+/**
+ * @brief Writes a changed color/brightness to the PWM registers
+ *
+ * Coroutine that writes one chunk of LEDs per call, yielding in between. If the color or
+ * brightness changes partway through, the write is finished and then started over with the new
+ * values.
+ *
+ * @return timeslice::CO_YIELDED if there are chunks left to write
+ *         timeslice::CO_DONE if all PWM registers are up to date
+ */
+timeslice::CoStatus is31fl3746a::update(void)
+{
+    static PWMValues pwm;
+    static int led;
+
+    CO_BEGIN(update_co);
+
+    while (pwm_dirty) {
+        pwm_dirty = false;
+        calc_pwm(pwm);
+
+        for (led = 0; led < NUM_LEDS; led += PWM_CHUNK_LEDS) {
+            write_pwm_chunk(led, pwm);
+            if ((led + PWM_CHUNK_LEDS) < NUM_LEDS) {
+                CO_YIELD(update_co);
+            }
+        }
+    }
+
+    CO_END(update_co);
+}
+
+/**
+ * @brief Checks if a PWM register write is partway through
+ *
+ * @return true if `is31fl3746a::update()` has yielded with chunks left to write
+ */
+bool is31fl3746a::is_busy(void)
+{
+    return CO_IS_RUNNING(update_co);
 }
 
 /**
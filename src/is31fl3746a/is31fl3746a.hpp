@@ -14,6 +14,7 @@
 
 #include <cstdint>
 
+#include "core/time_slice.hpp"
 #include "util/macros.hpp"
 
 /**
@@ -39,6 +40,12 @@ void set_color(uint32_t rgb_code);
 /// Set brightness for ALL RGB LEDs
 void set_brightness(uint8_t val);
 
+/// Write changed color/brightness to the LEDs, a chunk per call. coroutine, see time_slice.hpp
+timeslice::CoStatus update(void);
+
+/// Check if update() has yielded partway through writing the LEDs
+bool is_busy(void);
+
 /// Put driver into sleep mode; turn off all LEDs
 void sleep(void);
 
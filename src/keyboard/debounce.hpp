@@ -0,0 +1,183 @@
+/**
+ * @file      debounce.hpp
+ * @brief     Key matrix debounce algorithms
+ *
+ * @author    Anthony Needles
+ * @date      2020/10/12
+ * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
+ *
+ * Turns the raw scans of the key matrix into debounced key states. Both are kept as a bitmap of
+ * pressed rows for each column. The algorithm is picked per board in the BSP, and is fixed at
+ * compile time, so only the state the chosen algorithm needs takes up RAM.
+ *
+ * Each algorithm is cheap enough to run every scan at 1kHz. They only look at keys that are
+ * changing (or still settling), so a scan where no key changes costs a few operations per column.
+ */
+
+#ifndef KEYBOARD_DEBOUNCE_HPP_
+#define KEYBOARD_DEBOUNCE_HPP_
+
+#include <cstdint>
+
+/**
+ * @brief Debounce namespace
+ *
+ * This namespace holds the debounce algorithms for the key matrix.
+ */
+namespace debounce {
+
+/// Debounce algorithms, see the Debouncer specializations for each
+enum Algorithm {
+    EAGER,             ///< press right away, release after N released samples in a row
+    INTEGRATOR,        ///< change after N more samples disagree with the state than agree
+    VERTICAL_COUNTER,  ///< change after 4 disagreeing samples in a row, every key at once
+};
+
+/**
+ * @brief Debouncer class
+ *
+ * Specialized for each algorithm. `update()` is called with every raw scan, and updates the
+ * debounced state.
+ *
+ * @tparam ALGO     debounce algorithm
+ * @tparam NCOLS    number of matrix columns (one bitmap word each)
+ * @tparam NROWS    number of matrix rows (bits used in each word)
+ * @tparam SAMPLES  number of samples it takes to change state, where the algorithm allows
+ */
+template <Algorithm ALGO, unsigned NCOLS, unsigned NROWS, unsigned SAMPLES>
+class Debouncer;
+
+/**
+ * @brief Eager press, deferred release debouncer
+ *
+ * A key is pressed as soon as a single sample sees it pressed, so the press has no added latency.
+ * Bounces right after the press can't release it, since a release takes SAMPLES released samples in
+ * a row. Keys in the middle of releasing are tracked in a bitmap, so only they are counted.
+ */
+template <unsigned NCOLS, unsigned NROWS, unsigned SAMPLES>
+class Debouncer<EAGER, NCOLS, NROWS, SAMPLES> {
+    static_assert((SAMPLES > 0) && (SAMPLES < 256), "Debounce samples must fit in a byte");
+
+ public:
+    /// Take a raw scan, and update the debounced state
+    void update(const uint32_t raw[NCOLS], uint32_t state[NCOLS])
+    {
+        for (unsigned ncol = 0; ncol < NCOLS; ++ncol) {
+            // newly pressed keys are pressed right away
+            state[ncol] |= raw[ncol];
+
+            // pressed keys that sample released count up, any pressed sample restarts the count
+            uint32_t releasing = state[ncol] & ~raw[ncol];
+            _releasing[ncol] &= releasing;
+
+            for (unsigned nrow = 0; releasing != 0; ++nrow, releasing >>= 1) {
+                if ((releasing & 1u) == 0) {
+                    continue;
+                }
+
+                uint8_t &count = _counts[ncol*NROWS + nrow];
+                if ((_releasing[ncol] & (1u << nrow)) == 0) {
+                    _releasing[ncol] |= 1u << nrow;
+                    count = 0;
+                }
+
+                if (++count >= SAMPLES) {
+                    state[ncol]      &= ~(1u << nrow);
+                    _releasing[ncol] &= ~(1u << nrow);
+                }
+            }
+        }
+    }
+
+ private:
+    /// Keys that are pressed, but have been released for fewer than SAMPLES samples
+    uint32_t _releasing[NCOLS] = { };
+
+    /// Released samples in a row of each key, only valid while releasing
+    uint8_t _counts[NCOLS*NROWS] = { };
+};
+
+/**
+ * @brief Symmetric integrator debouncer
+ *
+ * Each key integrates samples that disagree with its state (counting up), and samples that agree
+ * (counting back down). Once SAMPLES more disagree than agree, the state changes. Press and release
+ * are treated the same, and a noisy key only changes once the noise is mostly one way.
+ */
+template <unsigned NCOLS, unsigned NROWS, unsigned SAMPLES>
+class Debouncer<INTEGRATOR, NCOLS, NROWS, SAMPLES> {
+    static_assert((SAMPLES > 0) && (SAMPLES < 256), "Debounce samples must fit in a byte");
+
+ public:
+    /// Take a raw scan, and update the debounced state
+    void update(const uint32_t raw[NCOLS], uint32_t state[NCOLS])
+    {
+        for (unsigned ncol = 0; ncol < NCOLS; ++ncol) {
+            uint32_t disagree = raw[ncol] ^ state[ncol];
+            uint32_t active   = disagree | _integrating[ncol];
+
+            for (unsigned nrow = 0; active != 0; ++nrow, active >>= 1, disagree >>= 1) {
+                if ((active & 1u) == 0) {
+                    continue;
+                }
+
+                uint8_t &count = _counts[ncol*NROWS + nrow];
+                if ((disagree & 1u) == 0) {
+                    count--;
+                } else if (++count >= SAMPLES) {
+                    state[ncol] ^= 1u << nrow;
+                    count = 0;
+                }
+
+                if (count == 0) {
+                    _integrating[ncol] &= ~(1u << nrow);
+                } else {
+                    _integrating[ncol] |= 1u << nrow;
+                }
+            }
+        }
+    }
+
+ private:
+    /// Keys with a non-zero integrator
+    uint32_t _integrating[NCOLS] = { };
+
+    /// Integrator of each key, only valid while integrating
+    uint8_t _counts[NCOLS*NROWS] = { };
+};
+
+/**
+ * @brief Vertical counter debouncer
+ *
+ * Every key in a column has a 2 bit counter, with the low bits of all the counters in one word and
+ * the high bits in another. So the counters of a whole column are stepped at once with a handful of
+ * bitwise operations. A counter counts the samples in a row that disagree with the key's state, and
+ * is reset by one that agrees. The state toggles when the counter wraps around, after 4
+ * disagreeing samples in a row (SAMPLES is not used).
+ */
+template <unsigned NCOLS, unsigned NROWS, unsigned SAMPLES>
+class Debouncer<VERTICAL_COUNTER, NCOLS, NROWS, SAMPLES> {
+ public:
+    /// Take a raw scan, and update the debounced state
+    void update(const uint32_t raw[NCOLS], uint32_t state[NCOLS])
+    {
+        for (unsigned ncol = 0; ncol < NCOLS; ++ncol) {
+            uint32_t delta = raw[ncol] ^ state[ncol];
+
+            // agreeing keys reset to 0, disagreeing keys count up and wrap from 3 to 0
+            _cnt0[ncol] = ~_cnt0[ncol] & delta;
+            _cnt1[ncol] = _cnt0[ncol] ^ (~_cnt1[ncol] & delta);
+
+            state[ncol] ^= delta & ~(_cnt0[ncol] | _cnt1[ncol]);
+        }
+    }
+
+ private:
+    /// Low and high bits of each key's counter
+    uint32_t _cnt0[NCOLS] = { };
+    uint32_t _cnt1[NCOLS] = { };
+};
+
+}  // namespace debounce
+
+#endif  // KEYBOARD_DEBOUNCE_HPP_
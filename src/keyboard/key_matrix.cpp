@@ -7,22 +7,66 @@
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
  * Used to detect keypress on a key matrix. The columns are set as outputs and rows set as inputs.
- * Each column is set high and each row is read.
+ * Each column is driven low in turn and the rows are read.
+ *
+ * The scan is driven by a scan plan, worked out at compile time from the BSP's `COLS` and `ROWS`.
+ * Each column is driven and released with a single BSRR write, each port with a row on it is read
+ * once per column (IDR), and the port reads are turned into a bitmap of rows with a short list of
+ * mask/shift runs (rows whose pins are consecutive on the same port are taken in one go).
+ *
+ * Each raw scan goes through the debounce algorithm picked in the BSP (see keyboard/debounce.hpp),
+ * at a 1ms scan period while keys are in use, so a debounced press can be seen within a millisecond
+ * or so. The longer the matrix goes unchanged, the slower it is scanned (down to every 10ms), and
+ * any change puts it straight back to 1ms.
+ *
+ * The matrix state is kept as a bitmap of pressed rows per column. Each debounced scan is XOR'd
+ * with the last one, and each key that changed becomes a key event (key index, pressed/released,
+ * timestamp). Only the events are processed, so a scan where nothing changed costs next to nothing
+ * past the scan itself.
+ *
+ * After each column, the rows are given time to pull back up before the next. This settle time is
+ * calibrated by timing how long each row takes to pull back up after being discharged, rather than
+ * guessed, since at a 1ms scan period the settle waits are most of the scan.
+ *
+ * If the BSP sets `DMA_SCAN`, the CPU doesn't scan at all. TIM3 triggers a sweep every scan period,
+ * and TIM1 steps through the columns, having the DMA write each step's column BSRR words (from a
+ * table worked out at compile time) and read the row port's IDR into a buffer once settled. The
+ * task only turns the last sweep's reads into row bitmaps. TIM1, TIM3, and DMA channels 2-5 shall
+ * not be used for anything else then.
+ *
+ * Unless the BSP has a diode on every key, the raw scan is first checked for ghosts (a key that
+ * reads pressed because three others around a rectangle are). New presses that could be ghosts are
+ * blocked until the ambiguity clears.
  *
  * When a key press is detected a function (defined as __weak in the source file) is called.
  * This function is defined as:
  *     void KeyPressCallback_X(void)
  * where X is the symbol given in KEY_TABLE.
+ *
+ * Once no key has been pressed for a while, scanning stops. Every column is driven low, and the
+ * rows' EXTI lines are armed for a falling edge, so the first key press interrupts. The interrupt
+ * resumes the (suspended) task right away for a full scan (see `timeslice::resume_from_isr()`), and
+ * scanning carries on every period until the matrix is quiet again.
  */
 
 #include "keyboard/key_matrix.hpp"
 
+#include "core/clock.hpp"
+#include "core/event.hpp"
 #include "core/gpio.hpp"
+#include "core/ring.hpp"
 #include "core/time_slice.hpp"
+#include "core/timer.hpp"
+#include "flash/persist.hpp"
+#include "keyboard/debounce.hpp"
 #include "keyboard/lighting.hpp"
+#include "usb/kb_hid.hpp"
+#include "usb/usb.hpp"
 #include "usb/usb_definitions.hpp"
+#include "util/bitop.hpp"
 #include "util/debug.hpp"
 #include "util/expressions.hpp"
+#include "util/macros.hpp"
 
 /// Default implementation of the callbacks does nothing
 #define K(symbol) __WEAK void callback_##symbol(void) {}
@@ -31,8 +75,22 @@ CALLBACK_KEY_TABLE(K)
 
 namespace {
 
-/// Task fuction will execute every 20ms
-constexpr unsigned KEY_MATRIX_TASK_PERIOD_MS = 20;
+/// Task fuction will execute every 1ms while keys are in use, and less often as they aren't
+constexpr unsigned KEY_MATRIX_TASK_PERIOD_MS = 1;
+
+/// A scan period, used once the matrix hasn't changed for `after_ms`
+struct ScanRate {
+    unsigned period_ms;
+    unsigned after_ms;
+};
+
+/// Scan periods, from the fastest (while typing) to the slowest (keys held, but not changing)
+constexpr ScanRate SCAN_RATES[] = {
+    { KEY_MATRIX_TASK_PERIOD_MS, 0    },
+    { 2,                         50   },
+    { 5,                         200  },
+    { 10,                        1000 },
+};
 
 /// Number of physical columns in matrix
 constexpr unsigned NUM_COLS = COUNT_OF(bsp::COLS);
@@ -40,259 +98,1988 @@ constexpr unsigned NUM_COLS = COUNT_OF(bsp::COLS);
 /// Number of physical rows in martrix
 constexpr unsigned NUM_ROWS = COUNT_OF(bsp::ROWS);
 
-/// Number of idle loops until lighting enters sleep mode
-constexpr unsigned IDLE_LOOPS_SLEEP = lighting::IDLE_MS_SLEEP/KEY_MATRIX_TASK_PERIOD_MS;
+/// Clock cycles in a microsecond
+constexpr uint32_t CYCLES_PER_US = clock::SYSCLK_HZ/1000000;
 
-enum CallbackState{
-    KEYUP = 0,
-    PRESSED,
-    UP_CHECK,
-};
+/// Time for a row to pull back up to VCC after its column is released, in microseconds. only used
+/// until the settle time is calibrated, or if calibration fails
+constexpr uint32_t ROW_SETTLE_US = 10;
+
+/// Settle time measurements taken of each row when calibrating. the longest is used
+constexpr unsigned SETTLE_SAMPLES = 8;
+
+/// A row that hasn't pulled back up in this long fails calibration, in microseconds
+constexpr uint32_t SETTLE_TIMEOUT_US = 100;
+
+/// Scans wait the measured settle time times this, plus `SETTLE_MIN_CYCLES`. a pressed key adds its
+/// column to what the pull up has to charge, which the calibration can't see
+constexpr uint32_t SETTLE_MARGIN = 2;
+
+/// Least settle time scans wait, in clock cycles
+constexpr uint32_t SETTLE_MIN_CYCLES = CYCLES_PER_US/2;
 
-/// Each physical key has 'base' key, and a 'fn' key. which is considered 'pressed' depends on if
-/// the FN key is pressed
-struct KeyLayer {
-    keymatrix::Key base;
-    keymatrix::Key fn;
+/// Time a driven column is given to pull a pressed key's row low before the rows are read, in
+/// clock cycles. the column drives the row hard, so this only has to cover the input synchronizer
+/// and the row's RC against its pull up, not the slow pull back up `settle_cycles` covers
+constexpr uint32_t DRIVE_SETTLE_CYCLES = CYCLES_PER_US/4;
+
+/// Time without a key pressed until scanning stops, and waits on the EXTI, in milliseconds
+constexpr uint32_t QUIET_MS_WAIT = 500;
+
+/// Number of scans the debouncer takes to change a key's state (at least 1). a key that is changing
+/// puts the scan rate back to the fastest, so the debouncer runs at `KEY_MATRIX_TASK_PERIOD_MS`
+constexpr unsigned DEBOUNCE_SCANS = (bsp::DEBOUNCE_MS + KEY_MATRIX_TASK_PERIOD_MS - 1)/
+    KEY_MATRIX_TASK_PERIOD_MS;
+
+/// A column's port, with the BSRR words that drive it low, and release it (high-Z, open drain)
+struct ScanCol {
+    gpio::Port port;
+    uint32_t drive_bsrr;
+    uint32_t release_bsrr;
 };
 
-/// The key buffer filled when when scanning
-struct KeyBuf {
-    KeyLayer buf[keymatrix::KEY_BUF_SIZE];
-    bool is_fn;
-    unsigned idx;
+/// A run of rows on consecutive pins of one port. its row bits are
+///     ((~IDR >> pin_shift) & mask) << first_row
+struct RowRun {
+    uint8_t port_idx;
+    uint8_t pin_shift;
+    uint8_t first_row;
+    uint32_t mask;
 };
 
-/// States for each of the callback keys
-struct CallbackStates {
-#define K(symbol) CallbackState symbol;
-    CALLBACK_KEY_TABLE(K)
-#undef K
+/// Everything needed to scan the matrix, without touching the pin tables
+struct ScanPlan {
+    ScanCol cols[NUM_COLS];
+    gpio::Port row_ports[NUM_ROWS];
+    unsigned num_row_ports;
+    RowRun runs[NUM_ROWS];
+    unsigned num_runs;
 };
 
-/// Macro expand base key symbol array. this holds every KEY_* enumeration value corresponding to
-/// every key, in order (for N columns and M rows):
-///   col0_row0, col1_row0, ..., colN_row0, col0_row1, col1_row1, ... colN_rowM
-constexpr keymatrix::Key base_keys[NUM_COLS*NUM_ROWS] = {
-#define K(symbol) HID_USAGE_KEYBOARD_##symbol,
-        BASE_TABLE(K)
-#undef K
+/**
+ * @brief Works out the scan plan from the BSP pin tables
+ *
+ * A row extends the current run if it is on the same port, and the pin after, as the row before.
+ *
+ * @return scan plan
+ */
+constexpr ScanPlan make_scan_plan(void)
+{
+    ScanPlan plan = { };
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        plan.cols[ncol].port         = bsp::COLS[ncol].port;
+        plan.cols[ncol].drive_bsrr   = 1u << (bsp::COLS[ncol].pin + 16);
+        plan.cols[ncol].release_bsrr = 1u << bsp::COLS[ncol].pin;
+    }
+
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        const gpio::Id row = bsp::ROWS[nrow];
+
+        unsigned port_idx = 0;
+        while ((port_idx < plan.num_row_ports) && (plan.row_ports[port_idx] != row.port)) {
+            port_idx++;
+        }
+        if (port_idx == plan.num_row_ports) {
+            plan.row_ports[plan.num_row_ports++] = row.port;
+        }
+
+        if ((nrow != 0) && (bsp::ROWS[nrow - 1].port == row.port) &&
+                ((bsp::ROWS[nrow - 1].pin + 1) == row.pin)) {
+            RowRun &run = plan.runs[plan.num_runs - 1];
+            run.mask = (run.mask << 1) | 1u;
+        } else {
+            RowRun &run  = plan.runs[plan.num_runs++];
+            run.port_idx  = static_cast<uint8_t>(port_idx);
+            run.pin_shift = static_cast<uint8_t>(row.pin);
+            run.first_row = static_cast<uint8_t>(nrow);
+            run.mask      = 1u;
+        }
+    }
+
+    return plan;
+}
+
+/// The scan plan for this BSP
+constexpr ScanPlan scan_plan = make_scan_plan();
+
+static_assert(NUM_ROWS <= 32, "Row bitmap must fit in a word");
+
+static_assert(keymatrix::NUM_KEYS <= 256, "Key index must fit in a byte");
+
+/// Steps in a DMA sweep: one for each column, then one to release the last column
+constexpr unsigned SWEEP_STEPS = NUM_COLS + 1;
+
+/// Column ports a DMA sweep can drive, one for each of TIM1 CC1-CC3 (CC4 reads the rows)
+constexpr unsigned SWEEP_MAX_PORTS = 3;
+
+/// TIM1 count at which the column writes of a step are done, and the settle time starts
+constexpr uint32_t SWEEP_WRITE_CYCLES = 4;
+
+/// TIM1 counts after the row read of a step, for the DMA to finish it before the next step
+constexpr uint32_t SWEEP_READ_CYCLES = 16;
+
+/// How long before each task call a DMA sweep is triggered, in microseconds
+constexpr uint32_t SWEEP_LEAD_US = 100;
+
+/// TIM3 counts microseconds, and triggers a sweep each time it wraps around
+constexpr uint32_t SWEEP_TIMER_HZ = 1000000;
+
+/// BSRR words written to each column port at each step of a DMA sweep. each step releases the
+/// column before it and drives its own, a word of 0 leaves the port as is
+struct DmaSweep {
+    gpio::Port ports[SWEEP_MAX_PORTS];
+    unsigned num_ports;
+    uint32_t bsrr[SWEEP_MAX_PORTS][SWEEP_STEPS];
 };
 
-/// Macro expand fn key symbol array. this holds every KEY_* enumeration value corresponding to
-/// every key, in order (for N columns and M rows):
+/**
+ * @brief Counts the ports with a column on them
+ *
+ * @return number of column ports
+ */
+constexpr unsigned count_col_ports(void)
+{
+    unsigned count = 0;
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        bool seen = false;
+        for (unsigned i = 0; i < ncol; ++i) {
+            seen = seen || (bsp::COLS[i].port == bsp::COLS[ncol].port);
+        }
+        count += seen ? 0 : 1;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Works out the DMA sweep from the scan plan
+ *
+ * Only used if the BSP scans with DMA, which needs the columns on no more than `SWEEP_MAX_PORTS`
+ * ports.
+ *
+ * @return DMA sweep
+ */
+constexpr DmaSweep make_dma_sweep(void)
+{
+    DmaSweep sweep = { };
+
+    for (unsigned ncol = 0; (ncol < NUM_COLS) && (count_col_ports() <= SWEEP_MAX_PORTS); ++ncol) {
+        const ScanCol &col = scan_plan.cols[ncol];
+
+        unsigned p = 0;
+        while ((p < sweep.num_ports) && (sweep.ports[p] != col.port)) {
+            p++;
+        }
+        if (p == sweep.num_ports) {
+            sweep.ports[sweep.num_ports++] = col.port;
+        }
+
+        sweep.bsrr[p][ncol]     |= col.drive_bsrr;
+        sweep.bsrr[p][ncol + 1] |= col.release_bsrr;
+    }
+
+    return sweep;
+}
+
+/// The DMA sweep for this BSP, in flash (the DMA reads it from there)
+constexpr DmaSweep dma_sweep = make_dma_sweep();
+
+static_assert(!bsp::DMA_SCAN || (count_col_ports() <= SWEEP_MAX_PORTS),
+        "DMA scanning needs the columns on no more than 3 ports");
+
+static_assert(!bsp::DMA_SCAN || (scan_plan.num_row_ports == 1),
+        "DMA scanning needs every row on one port");
+
+/// Macro expand the BSP's keymap, one layer per entry of its `LAYER_TABLE`. each layer holds every
+/// keycode, in order (for N columns and M rows):
 ///   col0_row0, col1_row0, ..., colN_row0, col0_row1, col1_row1, ... colN_rowM
-constexpr keymatrix::Key fn_keys[NUM_COLS*NUM_ROWS] = {
+constexpr keymatrix::Key default_keymap[][NUM_COLS*NUM_ROWS] = {
 #define K(symbol) HID_USAGE_KEYBOARD_##symbol,
-        FN_TABLE(K)
+#define LAYER(table) { table(K) },
+        LAYER_TABLE(LAYER)
+#undef LAYER
 #undef K
 };
 
-/// Index into key symbol array for corresponding base layer symbol
-constexpr keymatrix::Key GET_BASE_KEY(unsigned ncol, unsigned nrow)
+/// Number of keymap layers
+constexpr unsigned NUM_LAYERS = COUNT_OF(default_keymap);
+
+static_assert(NUM_LAYERS <= 32, "Layers that are on are kept as a bitmap in a word");
+
+/**
+ * @brief Checks if a keycode is a layer key (momentary, toggle, or one-shot)
+ *
+ * @param[in] key  keycode
+ *
+ * @return true if the keycode is a layer key
+ */
+constexpr bool is_layer_key(keymatrix::Key key)
 {
-    return base_keys[nrow*NUM_COLS + ncol];
+    return (key >= KEY(MO(0))) && (key < KEY(TRNS));
 }
 
-/// Index into key symbol array for corresponding fn layer symbol
-constexpr keymatrix::Key GET_FN_KEY(unsigned ncol, unsigned nrow)
+/**
+ * @brief Checks if a keycode is a macro key
+ *
+ * @param[in] key  keycode
+ *
+ * @return true if the keycode is a macro key
+ */
+constexpr bool is_macro_key(keymatrix::Key key)
 {
-    return fn_keys[nrow*NUM_COLS + ncol];
+    return (key >= KEY(MC(0))) && (key <= KEY(MC(0xFF)));
 }
 
-/// Buffer for current validated key, after checking for FN
-keymatrix::Key keys_in[keymatrix::KEY_BUF_SIZE];
+/**
+ * @brief Checks if a keycode is a tap-hold key (mod-tap or layer-tap)
+ *
+ * @param[in] key  keycode
+ *
+ * @return true if the keycode is a tap-hold key
+ */
+constexpr bool is_tap_hold_key(keymatrix::Key key)
+{
+    return (key >= 0x1000) && (key < 0x2000);
+}
 
-/// callback key states for all callback keys
-CallbackStates callback_states = { };
+/**
+ * @brief Gets the keycode a tap-hold key acts as when tapped
+ *
+ * @param[in] key  tap-hold keycode
+ *
+ * @return HID usage keycode
+ */
+constexpr keymatrix::Key tap_code(keymatrix::Key key)
+{
+    return static_cast<keymatrix::Key>(key & 0xFF);
+}
 
-/// Counting consecutive task loops without a key press
-unsigned idle_loops = 0;
+/**
+ * @brief Gets the keycode a tap-hold key acts as when held
+ *
+ * Bits 11:8 are the hold action, 0-7 for a modifier (LCTRL-RGUI) or 8-15 for a layer (0-7).
+ *
+ * @param[in] key  tap-hold keycode
+ *
+ * @return modifier keycode, or momentary layer keycode
+ */
+constexpr keymatrix::Key hold_code(keymatrix::Key key)
+{
+    unsigned hold = (static_cast<unsigned>(key) >> 8) & 0x0Fu;
+    return static_cast<keymatrix::Key>((hold < 8) ? (KEY(LCTRL) + hold) : KEY(MO(hold - 8)));
+}
 
 /**
- * @brief Scans the key matrix to detect key presses
+ * @brief Checks that a keycode is known, and that a layer it switches exists
  *
- * Will set each column and read each row for each column. This allows detection of individual
- * keys. If a key is found, its layer is pushed into the key buffer.
+ * @param[in] key  keycode
  *
- * @param[in,out] keybuf  buffer/info to fill
+ * @return true if the keycode is valid
  */
-void scan_matrix(KeyBuf *keybuf)
+constexpr bool is_valid_code(keymatrix::Key key)
 {
-    DBG_ASSERT(keybuf);
+    if (is_tap_hold_key(key)) {
+        key = hold_code(key);
+    }
 
-    bool full_break = false;
+    if (is_layer_key(key)) {
+        return (static_cast<unsigned>(key) & 0xFFu) < NUM_LAYERS;
+    }
 
-    // ensure all columns are inactive
-    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
-        // when set, the columns are open drain (i.e. high-z)
-        gpio::set_output(bsp::COLS[ncol]);
+    if (is_macro_key(key)) {
+        return (static_cast<unsigned>(key) & 0xFFu) < keymatrix::NUM_MACROS;
     }
 
-    // set columns, one by one
-    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
-        if (full_break) {
-            break;
+    return key <= KEY(TRNS);
+}
+
+/**
+ * @brief Checks that every keycode in the keymap is valid
+ *
+ * @return true if every keycode is valid
+ */
+constexpr bool check_keymap(void)
+{
+    for (unsigned layer = 0; layer < NUM_LAYERS; ++layer) {
+        for (keymatrix::Key key : default_keymap[layer]) {
+            if (!is_valid_code(key)) {
+                return false;
+            }
         }
+    }
+
+    return true;
+}
 
-        // when cleared, the columns are GND
-        gpio::clr_output(bsp::COLS[ncol]);
-
-        // and read each row for each set column
-        for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
-            // input is active low, since the active column is GND, and a button connects the input
-            // to the column. if the button is not pressed, the input is pulled high via pullup
-            gpio::PinState state = gpio::read_input(bsp::ROWS[nrow]);
-            if (state == gpio::CLR) {
-                keybuf->buf[keybuf->idx].base = GET_BASE_KEY(ncol, nrow);
-                if (keybuf->buf[keybuf->idx].base == KEY(FN)) {
-                    keybuf->is_fn = true;
-                } else {
-                    keybuf->buf[keybuf->idx].fn = GET_FN_KEY(ncol, nrow);
-                    keybuf->idx++;
-                    if (keybuf->idx >= keymatrix::KEY_BUF_SIZE) {
-                        full_break = true;
-                        break;
-                    }
+static_assert(check_keymap(), "Layer and macro keys must be in the BSP's LAYER_TABLE/MACRO_TABLE");
+
+/// Key events that can be held back while a tap-hold key is undecided
+constexpr unsigned TAP_HOLD_EVENTS = 8;
+
+/// How long a tap-hold key must be held to act as its hold keycode, in microseconds
+constexpr uint32_t TAP_HOLD_US = bsp::TAP_HOLD_MS*1000;
+
+/// How long the keys of a combo have to all be pressed within, in microseconds
+constexpr uint32_t COMBO_US = bsp::COMBO_MS*1000;
+
+/// A tap-hold key that is pressed, but not yet decided as tapped or held
+struct TapHold {
+    bool undecided;
+    uint8_t key;          ///< key index
+    keymatrix::Key code;  ///< tap-hold keycode
+    uint32_t time_us;     ///< time of the press
+};
+
+/// Most keys in a combo
+constexpr unsigned COMBO_KEYS_MAX = 8;
+
+/// Words in a bitmap with a bit for each key (by key index)
+constexpr unsigned KEY_WORDS = DIVIDE_ROUND(keymatrix::NUM_KEYS, 32u);
+
+/// Macro expand the keycode of each combo. ends with a sentinel, so a BSP can have no combos
+constexpr keymatrix::Key combo_codes[] = {
+#define COMBO(code, keys) KEY(code),
+    COMBO_TABLE(COMBO, K)
+#undef COMBO
+    KEY(NOEVT),
+};
+
+/// Number of combos (not counting the sentinel)
+constexpr unsigned NUM_COMBOS = COUNT_OF(combo_codes) - 1;
+
+/// Macro expand the base keycode of each key in each combo (the rest are NOEVT), then a sentinel
+constexpr keymatrix::Key combo_symbols[NUM_COMBOS + 1][COMBO_KEYS_MAX] = {
+#define K(symbol) KEY(symbol),
+#define COMBO(code, keys) { keys },
+    COMBO_TABLE(COMBO, K)
+#undef COMBO
+#undef K
+    { },
+};
+
+/// Keys that make key events: the matrix keys, then a virtual key for each combo
+constexpr unsigned NUM_EVENT_KEYS = keymatrix::NUM_KEYS + NUM_COMBOS;
+
+static_assert(NUM_EVENT_KEYS <= 256, "Key events hold the key index in a byte");
+
+/// Bitmaps of the keys in each combo, worked out from the base layer at compile time
+struct ComboTable {
+    uint32_t keys[NUM_COMBOS + 1][KEY_WORDS];  ///< keys in each combo (then the sentinel's)
+    uint32_t any[KEY_WORDS];                   ///< keys in any combo
+    bool valid;                                ///< set if every combo key is on the base layer once
+};
+
+/**
+ * @brief Works out the key bitmaps of the combos
+ *
+ * @return combo table
+ */
+constexpr ComboTable make_combo_table(void)
+{
+    ComboTable table = { };
+    table.valid = true;
+
+    for (unsigned ncombo = 0; ncombo < NUM_COMBOS; ++ncombo) {
+        unsigned num_keys = 0;
+        for (keymatrix::Key symbol : combo_symbols[ncombo]) {
+            if (symbol == KEY(NOEVT)) {
+                continue;
+            }
+
+            unsigned found = 0;
+            for (unsigned key = 0; key < keymatrix::NUM_KEYS; ++key) {
+                if (default_keymap[0][key] == symbol) {
+                    table.keys[ncombo][key/32] |= 1u << (key%32);
+                    table.any[key/32]          |= 1u << (key%32);
+                    found++;
                 }
             }
-        }
 
-        gpio::set_output(bsp::COLS[ncol]);
+            table.valid = table.valid && (found == 1);
+            num_keys++;
+        }
 
-        // ~10us delay. allows row to pull back up to VCC
-        LOOP_DELAY(40);
+        table.valid = table.valid && (num_keys >= 2);
     }
+
+    return table;
 }
 
-}  // namespace
+/// The combos' key bitmaps, in flash
+constexpr ComboTable combo_table = make_combo_table();
+
+static_assert(combo_table.valid, "Combo keys must each be on the base layer once, 2+ per combo");
+
+/// Key word of a remap slot that holds no remapped key
+constexpr uint16_t REMAP_EMPTY = 0xFFFF;
+
+/// Debouncer picked by the BSP
+debounce::Debouncer<bsp::DEBOUNCE_ALGORITHM, NUM_COLS, NUM_ROWS, DEBOUNCE_SCANS> debouncer;
+
+/// Debounced pressed rows of each column
+uint32_t debounced[NUM_COLS] = { };
+
+/// Pressed rows of each column, as of the last scan
+uint32_t matrix_state[NUM_COLS] = { };
+
+/// Keycode each key was pressed as (its layer is picked when pressed), so its release matches
+keymatrix::Key pressed_codes[NUM_EVENT_KEYS] = { };
+
+/// Keymap looked up by the scans: the BSP's keymap, with the remapped keys (saved in FLASH) merged
+keymatrix::Key keymap[NUM_LAYERS][NUM_COLS*NUM_ROWS];
+
+/// Key word (layer << 8 | key index) of each remap slot, as saved in FLASH
+uint16_t remap_slots[persist::REMAP_SLOTS];
+
+/// Number of momentary keys holding each layer on
+uint8_t layer_holds[NUM_LAYERS] = { };
+
+/// Layers toggled on
+uint32_t layers_toggled = 0;
+
+/// Layers on until the next key press (one-shot)
+uint32_t layers_oneshot = 0;
+
+/// Layers that are on, a bit for each. the base layer (0) is always on
+uint32_t layers_on = 1;
+
+/// Presses of combo keys held back while they may be a combo, in order
+keymatrix::KeyEvent combo_events[COMBO_KEYS_MAX];
+
+/// Number of combo key presses held back
+unsigned num_combo_events = 0;
+
+/// Keys whose presses are held back
+uint32_t combo_pressed[KEY_WORDS] = { };
+
+/// Keys of pressed combos, whose releases aren't passed on
+uint32_t combo_swallowed[KEY_WORDS] = { };
+
+/// Pressed combos, a bit for each
+uint32_t combos_on = 0;
+
+static_assert(NUM_COMBOS <= 32, "Pressed combos are kept as a bitmap in a word");
+
+/// Tap-hold key waiting to be decided
+TapHold tap_hold = { };
+
+/// Key events not yet acted on, in order. the first `num_held_events` are held back by the
+/// undecided tap-hold key, and the rest are waiting to be replayed
+keymatrix::KeyEvent pending_events[TAP_HOLD_EVENTS];
+
+/// Number of key events not yet acted on
+unsigned num_pending_events = 0;
+
+/// Number of key events held back by the undecided tap-hold key
+unsigned num_held_events = 0;
+
+/// Currently pressed keycodes, after the layer lookup
+keymatrix::KeyState key_state = { };
+
+/// Every change to `key_state`, in order, for the HID layer to replay
+Ring<keymatrix::CodeEvent, keymatrix::CODE_QUEUE_SIZE> code_events;
+
+/// Number of code events dropped because the queue was full
+volatile uint32_t code_overflows = 0;
+
+/// Time waited for the rows to settle after each column, in clock cycles
+uint32_t settle_cycles = ROW_SETTLE_US*CYCLES_PER_US;
+
+/// Row port reads of the last two DMA sweeps, one for each step. the DMA alternates halves
+volatile uint16_t sweep_buf[2*SWEEP_STEPS];
+
+/// Set while TIM3 is triggering DMA sweeps
+bool sweeping = false;
+
+/// Settle time measured of each row at the last calibration, in clock cycles
+uint32_t row_settle_cycles[NUM_ROWS] = { };
+
+/// Index into `SCAN_RATES` of the scan period in use
+unsigned scan_rate = 0;
+
+/// Millisecond count of the last scan that saw the matrix changing (or a key still debouncing)
+uint32_t last_active_ms = 0;
+
+/// Millisecond count of the last scan with a key press
+volatile uint32_t last_press_ms = 0;
+
+/// Set once no key has been pressed for `IDLE_MS_SLEEP`, until the next key press
+volatile bool idle = false;
+
+/// Set while the row EXTI lines are armed, waiting for a key press
+bool waiting = false;
 
 /**
- * @brief Initializes columns/rows
+ * @brief Waits for the rows to settle
  *
- * Takes the given row/columns gpio definitions and inits them as needed.
- * The inputs need a pullup or else they will float.
+ * Busy-waits on the SysTick clock cycle count, since the settle time is well under a microsecond
+ * timer tick.
  */
-void keymatrix::init(void)
+void wait_settle(void)
 {
-    // init each col gpio as open drain output
-    for (unsigned i = 0; i < NUM_COLS; ++i) {
-        gpio::enable_port_clock(bsp::COLS[i]);
-        gpio::set_mode(bsp::COLS[i], gpio::OUTPUT);
-        gpio::set_output_type(bsp::COLS[i], gpio::OPEN_DRAIN);
-    }
+    uint32_t start = timeslice::get_cycles();
 
-    // init each row gpio as pullup input
-    for (unsigned i = 0; i < NUM_ROWS; ++i) {
-        gpio::enable_port_clock(bsp::ROWS[i]);
-        gpio::set_mode(bsp::ROWS[i], gpio::INPUT);
-        gpio::set_pull(bsp::ROWS[i], gpio::PULL_UP);
-    }
+    while ((timeslice::get_cycles() - start) < settle_cycles) {}
+}
 
-    auto status = timeslice::register_task(KEY_MATRIX_TASK_PERIOD_MS, keymatrix::task);
-    DBG_ASSERT(status == timeslice::SUCCESS);
+/**
+ * @brief Waits for a driven column to pull the rows of its pressed keys low
+ *
+ * The column port is read back first, so the BSRR write has reached the port before the wait
+ * starts.
+ *
+ * @param[in] port  column port that was just written
+ */
+void wait_drive(gpio::Port port)
+{
+    (void)gpio::regs(port)->ODR;
 
-    debug::puts("Initialized: Key Matrix\r\n");
+    uint32_t start = timeslice::get_cycles();
+    while ((timeslice::get_cycles() - start) < DRIVE_SETTLE_CYCLES) {}
 }
 
 /**
- * @brief Calls key scan routine, fills key code buffer, calls callbacks
+ * @brief Measures how long a row takes to pull back up
+ *
+ * The row is driven low for a moment (discharging it, the same as a pressed key on a driven
+ * column), then set back as an input, and timed until it reads high. Interrupts are masked while
+ * timing, so the measurement isn't stretched.
  *
- * This task will scan the physical keys each task period. The output key_in buffer will hold the
- * actual keycodes for this set, either the base keys of fn keys (if FN key also pressed). If any
- * of the callback keys are newly pressed, the callbacks get called, otherwise their states get
- * updated accordingly.
+ * @param[in] row  row to measure
+ *
+ * @return settle time, in clock cycles. `SETTLE_TIMEOUT_US` worth if it never pulled back up
  */
-void keymatrix::task(void)
+uint32_t measure_row_settle(gpio::Id row)
 {
-    KeyBuf keybuf;
-    keymatrix::Key key;
+    constexpr uint32_t TIMEOUT_CYCLES = SETTLE_TIMEOUT_US*CYCLES_PER_US;
+    uint32_t longest = 0;
 
-    // clear our key buffer and key_in buffer
-    for (unsigned i = 0; i < KEY_BUF_SIZE; ++i) {
-        keys_in[i]         = KEY(NOEVT);
-        keybuf.buf[i].base = KEY(NOEVT);
-        keybuf.buf[i].fn   = KEY(NOEVT);
-    }
-    keybuf.idx   = 0;
-    keybuf.is_fn = false;
+    for (unsigned i = 0; i < SETTLE_SAMPLES; ++i) {
+        __disable_irq();
 
-    // fill buffer with pressed keys
-    scan_matrix(&keybuf);
+        gpio::clr_output(row);
+        gpio::set_mode(row, gpio::OUTPUT);
+        timer::delay_us(1);
 
-    // if there hasn't been any keypresses, we consider the keyboard idle
-    if (keybuf.idx == 0) {
-        // saturate counter
-        if (idle_loops < IDLE_LOOPS_SLEEP) {
-            idle_loops++;
+        gpio::set_mode(row, gpio::INPUT);
+        uint32_t start   = timeslice::get_cycles();
+        uint32_t elapsed = 0;
+        while ((gpio::read_input(row) == gpio::CLR) && (elapsed < TIMEOUT_CYCLES)) {
+            elapsed = timeslice::get_cycles() - start;
         }
-    } else {
-        idle_loops = 0;
-    }
 
-    for (unsigned i = 0; i < keybuf.idx; ++i) {
-        // find the keycode for the given key layer in buffer
-        if (keybuf.is_fn) {
-            key = keybuf.buf[i].fn;
-        } else {
-            key = keybuf.buf[i].base;
+        __enable_irq();
+
+        if (elapsed > longest) {
+            longest = elapsed;
         }
+    }
 
-        // call any callback functions only if key just pressed. update state as PRESSED
-        switch (key) {
-    #define K(symbol)                              \
-        case KEY(symbol):                          \
-            if (callback_states.symbol == KEYUP) { \
-                keymatrix::callback_##symbol();      \
-            }                                      \
-            callback_states.symbol = PRESSED;      \
-            break;
-        CALLBACK_KEY_TABLE(K)
-    #undef K
-        default:
-            break;
+    return longest;
+}
+
+/**
+ * @brief Calibrates the row settle time
+ *
+ * Each row is measured, and scans wait for the slowest (plus margin). If a row doesn't pull back up
+ * (e.g. a stuck pin), the settle time is left as is. Nothing is printed, see `print_settle()`.
+ */
+void calibrate_settle(void)
+{
+    uint32_t longest = 0;
+
+    // a key on a driven column would hold its row low
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        gpio::regs(scan_plan.cols[ncol].port)->BSRR = scan_plan.cols[ncol].release_bsrr;
+    }
+
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        row_settle_cycles[nrow] = measure_row_settle(bsp::ROWS[nrow]);
+        if (row_settle_cycles[nrow] >= SETTLE_TIMEOUT_US*CYCLES_PER_US) {
+            return;
         }
 
-        // non-user keys get put into the key_in buffer
-        if ((int16_t)key >= 0) {
-            keys_in[i] = key;
+        if (row_settle_cycles[nrow] > longest) {
+            longest = row_settle_cycles[nrow];
         }
     }
 
-    // if the key is pressed, the next time through we check if its pressed again. if the state
-    // is still UP_CHECK, then we know the key has been released
-    #define K(symbol)                                    \
-        if (callback_states.symbol == PRESSED) {         \
-            callback_states.symbol = UP_CHECK;           \
-        } else if (callback_states.symbol == UP_CHECK) { \
-            callback_states.symbol = KEYUP;              \
-        }
-        CALLBACK_KEY_TABLE(K)
-    #undef K
+    settle_cycles = longest*SETTLE_MARGIN + SETTLE_MIN_CYCLES;
 }
 
 /**
- * @brief Fills input buffer with current key buffer
+ * @brief Prints the last settle time calibration to the debug output
  *
- * @param[in,out] keybuf  buffer/info to fill into (assumed size = KEY_BUF_SIZE)
+ * Only called from init or the loop, never from the task, since printing blocks for milliseconds.
  */
-void keymatrix::copy_key_buffer(keymatrix::Key *keybuf)
+void print_settle(void)
 {
-    DBG_ASSERT(keybuf);
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        if (row_settle_cycles[nrow] >= SETTLE_TIMEOUT_US*CYCLES_PER_US) {
+            debug::printf("WARNING: Key matrix row %u did not settle, keeping %u cycles\r\n", nrow,
+                    settle_cycles);
+            return;
+        }
 
-    for (unsigned i = 0; i < KEY_BUF_SIZE; ++i) {
-        keybuf[i] = keys_in[i];
+        debug::printf("Key matrix row %u settles in %u cycles\r\n", nrow, row_settle_cycles[nrow]);
     }
+
+    debug::printf("Key matrix settle time: %u cycles (%uns)\r\n", settle_cycles,
+            (settle_cycles*1000)/CYCLES_PER_US);
 }
 
 /**
- * @brief Returns whether the keyboard is idle
+ * @brief Scans the key matrix to detect key presses
  *
- * If no key presses have occurred in `IDLE_MS_SLEEP`, the keyboard is considered idle.
+ * Drives each column and reads the rows, giving a bitmap of pressed rows for each column.
  *
- * @return if keyboard is idle
+ * @param[out] cols  filled with the pressed rows of each column
  */
-bool keymatrix::is_idle(void)
+void scan_matrix(uint32_t cols[NUM_COLS])
+{
+    uint32_t idr[NUM_ROWS];
+
+    // ensure all columns are inactive
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        // when set, the columns are open drain (i.e. high-z)
+        gpio::regs(scan_plan.cols[ncol].port)->BSRR = scan_plan.cols[ncol].release_bsrr;
+    }
+
+    // set columns, one by one
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        const ScanCol &col = scan_plan.cols[ncol];
+
+        // when cleared, the columns are GND. let the rows follow, read every row port, then release
+        gpio::regs(col.port)->BSRR = col.drive_bsrr;
+        wait_drive(col.port);
+        for (unsigned i = 0; i < scan_plan.num_row_ports; ++i) {
+            idr[i] = gpio::regs(scan_plan.row_ports[i])->IDR;
+        }
+        gpio::regs(col.port)->BSRR = col.release_bsrr;
+
+        // input is active low, since the active column is GND, and a button connects the input to
+        // the column. if the button is not pressed, the input is pulled high via pullup
+        uint32_t row_bits = 0;
+        for (unsigned i = 0; i < scan_plan.num_runs; ++i) {
+            const RowRun &run = scan_plan.runs[i];
+            row_bits |= ((~idr[run.port_idx] >> run.pin_shift) & run.mask) << run.first_row;
+        }
+        cols[ncol] = row_bits;
+
+        // allows row to pull back up to VCC
+        wait_settle();
+    }
+}
+
+/**
+ * @brief Gets the DMA channel that writes a sweep port
+ *
+ * These are the channels TIM1 CC1-CC3 requests are wired to.
+ *
+ * @param[in] p  index of the port in the DMA sweep
+ *
+ * @return DMA channel
+ */
+DMA_Channel_TypeDef *sweep_write_channel(unsigned p)
+{
+    switch (p) {
+    case 0:
+        return DMA1_Channel2;
+    case 1:
+        return DMA1_Channel3;
+    default:
+        return DMA1_Channel5;
+    }
+}
+
+/**
+ * @brief Gets the address of a register, as the DMA takes it
+ *
+ * @param[in] reg  register (or buffer)
+ *
+ * @return address
+ */
+uint32_t dma_addr(const volatile void *reg)
+{
+    return static_cast<uint32_t>(reinterpret_cast<uintptr_t>(reg));
+}
+
+/**
+ * @brief Sets the timing of each DMA sweep step from the settle time
+ *
+ * At the start of each step, TIM1 CC1-CC3 have the DMA write each column port's BSRR word. The rows
+ * are then left to settle, and CC4 has the DMA read the row port. Must only be called while no
+ * sweep is running.
+ */
+void set_sweep_timing(void)
+{
+    DBG_ASSERT((settle_cycles < (0xFFFF - SWEEP_WRITE_CYCLES - SWEEP_READ_CYCLES)));
+
+    TIM1->CCR1 = 1;
+    TIM1->CCR2 = 2;
+    TIM1->CCR3 = 3;
+    TIM1->CCR4 = SWEEP_WRITE_CYCLES + settle_cycles;
+    TIM1->ARR  = SWEEP_WRITE_CYCLES + settle_cycles + SWEEP_READ_CYCLES;
+}
+
+/**
+ * @brief Sets up the timers and DMA channels for DMA sweeps
+ *
+ * TIM3 counts microseconds, and its update (each scan period) triggers TIM1. TIM1 runs one pulse,
+ * with its repetition counter making the pulse `SWEEP_STEPS` periods long, one per step. Its
+ * compare channels request the DMA transfers of each step. Every DMA channel is circular, so each
+ * sweep leaves it back at the start for the next, and the row reads alternate between the halves
+ * of `sweep_buf`. No interrupts are used.
+ */
+void init_dma_scan(void)
+{
+    bitop::set_msk(RCC->AHBENR,  RCC_AHBENR_DMAEN);
+    bitop::set_msk(RCC->APB2ENR, RCC_APB2ENR_TIM1EN);
+    bitop::set_msk(RCC->APB1ENR, RCC_APB1ENR_TIM3EN);
+
+    // TIM3 counts microseconds, its update is the trigger output. the period is set when started
+    TIM3->PSC = (clock::SYSCLK_HZ/SWEEP_TIMER_HZ) - 1;
+    TIM3->CR1 = TIM_CR1_ARPE;
+    TIM3->CR2 = TIM_CR2_MMS_1;
+
+    // column writes, from the flash tables to each port's BSRR
+    for (unsigned p = 0; p < dma_sweep.num_ports; ++p) {
+        DMA_Channel_TypeDef *ch = sweep_write_channel(p);
+        ch->CPAR  = dma_addr(&gpio::regs(dma_sweep.ports[p])->BSRR);
+        ch->CMAR  = dma_addr(dma_sweep.bsrr[p]);
+        ch->CNDTR = SWEEP_STEPS;
+        ch->CCR   = DMA_CCR_PL_1 | DMA_CCR_MSIZE_1 | DMA_CCR_PSIZE_1 | DMA_CCR_MINC | DMA_CCR_CIRC |
+            DMA_CCR_DIR | DMA_CCR_EN;
+        bitop::set_msk(TIM1->DIER, TIM_DIER_CC1DE << p);
+    }
+
+    // row reads, from the row port's IDR into the sweep buffer
+    DMA1_Channel4->CPAR  = dma_addr(&gpio::regs(scan_plan.row_ports[0])->IDR);
+    DMA1_Channel4->CMAR  = dma_addr(sweep_buf);
+    DMA1_Channel4->CNDTR = 2*SWEEP_STEPS;
+    DMA1_Channel4->CCR   = DMA_CCR_PL | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0 | DMA_CCR_MINC |
+        DMA_CCR_CIRC | DMA_CCR_EN;
+    bitop::set_msk(TIM1->DIER, TIM_DIER_CC4DE);
+
+    // TIM1 runs a sweep (one pulse, SWEEP_STEPS periods) on each TIM3 trigger (ITR2)
+    set_sweep_timing();
+    TIM1->PSC = 0;
+    TIM1->RCR = SWEEP_STEPS - 1;
+    TIM1->CR1 = TIM_CR1_OPM;
+    TIM1->EGR = TIM_EGR_UG;
+    TIM1->SMCR = TIM_SMCR_TS_1 | TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1;
+}
+
+/**
+ * @brief Waits for a DMA sweep in progress to finish
+ *
+ * A sweep takes `SWEEP_STEPS` TIM1 periods, so a few tens of microseconds at most.
+ */
+void wait_sweep(void)
+{
+    while (bitop::read_bit(TIM1->CR1, TIM_CR1_CEN_Pos) != 0) {}
+}
+
+/**
+ * @brief Starts DMA sweeps, with one right away
+ *
+ * TIM3 is started so it triggers `SWEEP_LEAD_US` ahead of each task call (the task calls this
+ * right as it is released), so a fresh sweep is waiting for each call.
+ *
+ * @param[in] period_ms  scan period, in milliseconds
+ */
+void start_sweeps(unsigned period_ms)
+{
+    // the columns are released between sweeps
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        gpio::regs(scan_plan.cols[ncol].port)->BSRR = scan_plan.cols[ncol].release_bsrr;
+    }
+
+    // load the period, without the update triggering a sweep
+    TIM3->ARR = (period_ms*SWEEP_TIMER_HZ)/1000 - 1;
+    bitop::clr_msk(TIM1->SMCR, TIM_SMCR_SMS_Msk);
+    TIM3->EGR = TIM_EGR_UG;
+    bitop::set_msk(TIM1->SMCR, TIM_SMCR_SMS_2 | TIM_SMCR_SMS_1);
+
+    TIM3->CNT = SWEEP_LEAD_US;
+    bitop::set_msk(TIM3->CR1, TIM_CR1_CEN);
+    bitop::set_msk(TIM1->CR1, TIM_CR1_CEN);
+    sweeping = true;
+}
+
+/**
+ * @brief Stops DMA sweeps
+ *
+ * A sweep in progress is let finish, so the columns end up released and every DMA channel is back
+ * at the start of a sweep.
+ */
+void stop_sweeps(void)
+{
+    bitop::clr_msk(TIM3->CR1, TIM_CR1_CEN);
+    wait_sweep();
+    sweeping = false;
+}
+
+/**
+ * @brief Gets the rows of the last DMA sweep
+ *
+ * The row reads alternate halves of `sweep_buf`, and each half completing sets a DMA flag. If
+ * either is set, the half the DMA will write next is the older one (or is being written), so the
+ * other is taken. It isn't written again until a whole sweep later.
+ *
+ * @param[out] cols  filled with the pressed rows of each column
+ *
+ * @return true if a sweep has finished since the last call, false if not (and `cols` is left as is)
+ */
+bool read_sweep(uint32_t cols[NUM_COLS])
+{
+    constexpr uint32_t SWEEP_DONE = DMA_ISR_HTIF4 | DMA_ISR_TCIF4;
+
+    if ((DMA1->ISR & SWEEP_DONE) == 0) {
+        return false;
+    }
+    DMA1->IFCR = DMA_IFCR_CHTIF4 | DMA_IFCR_CTCIF4;
+
+    unsigned half = (DMA1_Channel4->CNDTR > SWEEP_STEPS) ? 1 : 0;
+    const volatile uint16_t *idr = &sweep_buf[half*SWEEP_STEPS];
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        uint32_t row_bits = 0;
+        for (unsigned i = 0; i < scan_plan.num_runs; ++i) {
+            const RowRun &run = scan_plan.runs[i];
+            row_bits |= ((~static_cast<uint32_t>(idr[ncol]) >> run.pin_shift) & run.mask) <<
+                run.first_row;
+        }
+        cols[ncol] = row_bits;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Checks if a bitmap has two or more bits set
+ *
+ * Clearing the lowest set bit leaves something only if there was more than one. Cheaper than a
+ * popcount on the Cortex-M0, which has no instruction for it.
+ *
+ * @param[in] bits  bitmap
+ *
+ * @return true if two or more bits are set
+ */
+inline bool has_multiple(uint32_t bits)
+{
+    return (bits & (bits - 1)) != 0;
+}
+
+/**
+ * @brief Blocks new presses that could be ghosts
+ *
+ * Without a diode per key, three keys pressed on the corners of a rectangle (two columns sharing
+ * two rows) pull the row of the fourth corner low too, so it reads pressed. Which of the four is
+ * the ghost can't be told, so wherever two columns share two or more pressed rows, new presses on
+ * those rows are blocked in both. Keys already pressed stay pressed, and releases go through, so a
+ * blocked key reads pressed once the rectangle is broken.
+ *
+ * Only columns with two or more rows pressed can be part of a rectangle, so the pairwise check is
+ * only done between those. With a few keys held, that is one check per column.
+ *
+ * @param[in,out] raw    pressed rows of each column, as scanned. ghost candidates are cleared
+ * @param[in]     state  pressed rows of each column, as debounced
+ */
+void block_ghosts(uint32_t raw[NUM_COLS], const uint32_t state[NUM_COLS])
+{
+    uint8_t multi[NUM_COLS];
+    unsigned nmulti = 0;
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        if (has_multiple(raw[ncol])) {
+            multi[nmulti++] = static_cast<uint8_t>(ncol);
+        }
+    }
+
+    if (nmulti < 2) {
+        return;
+    }
+
+    // found against the raw scan as a whole, then cleared, so one block can't hide another
+    uint32_t blocked[NUM_COLS] = { };
+    for (unsigned i = 0; i < nmulti; ++i) {
+        for (unsigned j = i + 1; j < nmulti; ++j) {
+            unsigned a = multi[i];
+            unsigned b = multi[j];
+            uint32_t shared = raw[a] & raw[b];
+            if (has_multiple(shared)) {
+                blocked[a] |= shared & ~state[a];
+                blocked[b] |= shared & ~state[b];
+            }
+        }
+    }
+
+    for (unsigned i = 0; i < nmulti; ++i) {
+        raw[multi[i]] &= ~blocked[multi[i]];
+    }
+}
+
+/**
+ * @brief Queues a change to the key state
+ *
+ * If the queue is full, the event is dropped and counted. The consumer then has to catch up by
+ * copying the whole key state.
+ *
+ * @param[in] key      keycode
+ * @param[in] pressed  true if pressed, false if released
+ * @param[in] time_us  time of the scan that saw it
+ */
+void queue_code_event(keymatrix::Key key, bool pressed, uint32_t time_us)
+{
+    if (!code_events.push({ key, pressed, time_us })) {
+        code_overflows++;
+    }
+}
+
+/**
+ * @brief Adds a keycode to the key state
+ *
+ * @param[in] key      keycode to add
+ * @param[in] time_us  time of the scan that saw it
+ */
+void add_key(keymatrix::Key key, uint32_t time_us)
+{
+    DBG_ASSERT((static_cast<unsigned>(key) < keymatrix::NUM_KEYCODES));
+
+    uint32_t bit = 1u << (key%32);
+    if ((key_state.keycodes[key/32] & bit) != 0) {
+        return;
+    }
+
+    key_state.keycodes[key/32] |= bit;
+    queue_code_event(key, true, time_us);
+}
+
+/**
+ * @brief Removes a keycode from the key state
+ *
+ * The keycode is only released once no pressed key is using it, so two keys with the same keycode
+ * (e.g. on different layers) don't release each other.
+ *
+ * @param[in] key      keycode to remove
+ * @param[in] time_us  time of the scan that saw it
+ */
+void remove_key(keymatrix::Key key, uint32_t time_us)
+{
+    DBG_ASSERT((static_cast<unsigned>(key) < keymatrix::NUM_KEYCODES));
+
+    for (unsigned i = 0; i < NUM_EVENT_KEYS; ++i) {
+        if (pressed_codes[i] == key) {
+            return;
+        }
+    }
+
+    uint32_t bit = 1u << (key%32);
+    if ((key_state.keycodes[key/32] & bit) == 0) {
+        return;
+    }
+
+    key_state.keycodes[key/32] &= ~bit;
+    queue_code_event(key, false, time_us);
+}
+
+/**
+ * @brief Gets the persistent data word holding the key word of a remap slot
+ *
+ * @param[in] slot  remap slot
+ *
+ * @return persistent data word, the slot's keycode word is the one after it
+ */
+inline persist::DataId remap_key_id(unsigned slot)
+{
+    return static_cast<persist::DataId>(persist::REMAP0_KEY + 2*slot);
+}
+
+/**
+ * @brief Gets the persistent data word holding the keycode of a remap slot
+ *
+ * @param[in] slot  remap slot
+ *
+ * @return persistent data word
+ */
+inline persist::DataId remap_code_id(unsigned slot)
+{
+    return static_cast<persist::DataId>(persist::REMAP0_CODE + 2*slot);
+}
+
+/**
+ * @brief Checks that a key can be remapped to a keycode
+ *
+ * @param[in] layer  keymap layer
+ * @param[in] key    key index (see `keymatrix::NUM_KEYS`)
+ * @param[in] code   keycode
+ *
+ * @return true if the layer and key exist, and the keycode is valid (see `is_valid_code()`)
+ */
+bool is_valid_remap(unsigned layer, unsigned key, keymatrix::Key code)
+{
+    return (layer < NUM_LAYERS) && (key < keymatrix::NUM_KEYS) && is_valid_code(code);
+}
+
+/**
+ * @brief Finds the remap slot holding a key word
+ *
+ * @param[in] key_word  key word (layer << 8 | key index), or REMAP_EMPTY for a free slot
+ *
+ * @return remap slot, or persist::REMAP_SLOTS if there is none
+ */
+unsigned find_remap_slot(uint16_t key_word)
+{
+    unsigned slot = 0;
+    while ((slot < persist::REMAP_SLOTS) && (remap_slots[slot] != key_word)) {
+        slot++;
+    }
+
+    return slot;
+}
+
+/**
+ * @brief Sets a key's keycode in the keymap that is looked up
+ *
+ * @param[in] layer  keymap layer
+ * @param[in] key    key index (see `keymatrix::NUM_KEYS`)
+ * @param[in] code   keycode
+ */
+void set_keymap(unsigned layer, unsigned key, keymatrix::Key code)
+{
+    timeslice::lock();
+    keymap[layer][key] = code;
+    timeslice::unlock();
+}
+
+/**
+ * @brief Loads the keymap: the BSP's keymap, with each key remapped in FLASH merged in
+ *
+ * Remap slots that were never written are created empty, and ones that don't hold a valid remap
+ * are ignored (and free to be used again).
+ */
+void load_keymap(void)
+{
+    for (unsigned layer = 0; layer < NUM_LAYERS; ++layer) {
+        for (unsigned key = 0; key < keymatrix::NUM_KEYS; ++key) {
+            keymap[layer][key] = default_keymap[layer][key];
+        }
+    }
+
+    for (unsigned slot = 0; slot < persist::REMAP_SLOTS; ++slot) {
+        uint16_t key_word;
+        uint16_t code_word = 0;
+
+        persist::read_or_create_data(remap_key_id(slot), key_word, REMAP_EMPTY);
+        remap_slots[slot] = key_word;
+        if (key_word == REMAP_EMPTY) {
+            continue;
+        }
+
+        unsigned layer = key_word >> 8;
+        unsigned key   = key_word & 0xFFu;
+        bool valid     = (persist::read_data(remap_code_id(slot), code_word) == persist::SUCCESS);
+        auto code      = static_cast<keymatrix::Key>(code_word);
+        if (!valid || !is_valid_remap(layer, key, code)) {
+            debug::printf("WARNING: remap slot %u invalid (0x%04x), ignored\r\n", slot, key_word);
+            remap_slots[slot] = REMAP_EMPTY;
+            continue;
+        }
+
+        keymap[layer][key] = code;
+    }
+}
+
+/**
+ * @brief Updates which layers are on, from the momentary, toggled, and one-shot layers
+ */
+void update_layers(void)
+{
+    uint32_t on = 1u | layers_toggled | layers_oneshot;
+    for (unsigned layer = 0; layer < NUM_LAYERS; ++layer) {
+        if (layer_holds[layer] != 0) {
+            on |= 1u << layer;
+        }
+    }
+
+    layers_on = on;
+}
+
+/**
+ * @brief Looks up the keycode of a key, in the layers that are on
+ *
+ * Layers are looked at from the highest down, one read each, until one that isn't transparent for
+ * the key. Layers that are off are skipped without reading the keymap. A combo's virtual key is
+ * its combo's keycode on every layer.
+ *
+ * @param[in] key  key index (see `NUM_EVENT_KEYS`)
+ *
+ * @return keycode of the key. transparent all the way down to the base layer is NOEVT
+ */
+keymatrix::Key lookup_key(unsigned key)
+{
+    if (key >= keymatrix::NUM_KEYS) {
+        return combo_codes[key - keymatrix::NUM_KEYS];
+    }
+
+    for (unsigned layer = NUM_LAYERS - 1; layer > 0; --layer) {
+        if ((layers_on & (1u << layer)) == 0) {
+            continue;
+        }
+
+        keymatrix::Key code = keymap[layer][key];
+        if (code != KEY(TRNS)) {
+            return code;
+        }
+    }
+
+    keymatrix::Key code = keymap[0][key];
+    return (code == KEY(TRNS)) ? KEY(NOEVT) : code;
+}
+
+/**
+ * @brief Processes a layer key press or release
+ *
+ * @param[in] key      layer keycode (see `is_layer_key()`)
+ * @param[in] pressed  true if the key was pressed, false if released
+ */
+void handle_layer_key(keymatrix::Key key, bool pressed)
+{
+    unsigned layer = static_cast<unsigned>(key) & 0xFFu;
+    uint32_t bit   = 1u << layer;
+
+    switch (key & 0xFF00) {
+    case KEY(MO(0)):
+        if (pressed) {
+            layer_holds[layer]++;
+        } else if (layer_holds[layer] != 0) {
+            layer_holds[layer]--;
+        }
+        break;
+    case KEY(TG(0)):
+        if (pressed) {
+            layers_toggled ^= bit;
+        }
+        break;
+    case KEY(OS(0)):
+        if (pressed) {
+            layers_oneshot |= bit;
+        }
+        break;
+    default:
+        break;
+    }
+
+    update_layers();
+}
+
+/**
+ * @brief Acts on a key press or release, as the keycode it was resolved to
+ *
+ * Layer keys switch layers, callback keys have their callback called on press, macro keys are
+ * queued for the HID layer on press, and every other keycode goes into the pressed key buffer
+ * until released. Any other key press uses up the one-shot layers.
+ *
+ * @param[in] evt  key event
+ * @param[in] key  keycode of the key
+ */
+void apply_key(const keymatrix::KeyEvent &evt, keymatrix::Key key)
+{
+    if (is_layer_key(key)) {
+        handle_layer_key(key, evt.pressed);
+        return;
+    }
+
+    if (is_macro_key(key)) {
+        if (evt.pressed) {
+            queue_code_event(key, true, evt.time_us);
+        }
+        return;
+    }
+
+    if (evt.pressed && (key != KEY(NOEVT)) && (layers_oneshot != 0)) {
+        layers_oneshot = 0;
+        update_layers();
+    }
+
+    switch (key) {
+#define K(symbol)                           \
+    case KEY(symbol):                       \
+        if (evt.pressed) {                  \
+            keymatrix::callback_##symbol(); \
+        }                                   \
+        break;
+    CALLBACK_KEY_TABLE(K)
+#undef K
+    case KEY(NOEVT):
+        break;
+    default:
+        // keycodes in the HID usage range get put into the key state
+        if ((key > 0) && (key < static_cast<keymatrix::Key>(keymatrix::NUM_KEYCODES))) {
+            if (evt.pressed) {
+                add_key(key, evt.time_us);
+            } else {
+                remove_key(key, evt.time_us);
+            }
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Decides the undecided tap-hold key
+ *
+ * The tap-hold key is pressed (as of its press time) as its hold or tap keycode, which its release
+ * will match. The key events held back meanwhile are then replayed, as if just seen, so they are
+ * looked up in the layers as they are now (e.g. with a held layer on).
+ *
+ * @param[in] hold  true if the key is held, false if tapped
+ */
+void decide_tap_hold(bool hold)
+{
+    keymatrix::Key key = hold ? hold_code(tap_hold.code) : tap_code(tap_hold.code);
+    tap_hold.undecided = false;
+    pressed_codes[tap_hold.key] = key;
+    apply_key({ tap_hold.key, true, tap_hold.time_us }, key);
+
+    num_held_events = 0;
+}
+
+/**
+ * @brief Holds back the next pending key event, deciding the tap-hold key if the event does
+ *
+ * The tap-hold key is tapped if it is released first. It is held once another key is pressed and
+ * released within it (if `bsp::PERMISSIVE_HOLD`), or once another key is pressed at all (if
+ * `bsp::HOLD_ON_OTHER_PRESS`).
+ */
+void hold_back_event(void)
+{
+    const keymatrix::KeyEvent &evt = pending_events[num_held_events];
+
+    // the release itself is replayed after the events before it
+    if (evt.key == tap_hold.key) {
+        decide_tap_hold(false);
+        return;
+    }
+
+    num_held_events++;
+
+    if (evt.pressed) {
+        if (bsp::HOLD_ON_OTHER_PRESS) {
+            decide_tap_hold(true);
+        }
+        return;
+    }
+
+    if (bsp::PERMISSIVE_HOLD) {
+        for (unsigned i = 0; i < (num_held_events - 1); ++i) {
+            if (pending_events[i].pressed && (pending_events[i].key == evt.key)) {
+                decide_tap_hold(true);
+                return;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Acts on the first pending key event (only while no tap-hold key is undecided)
+ *
+ * A pressed key takes its keycode from the layers that are on (see `lookup_key()`), and its release
+ * matches it. A pressed tap-hold key is undecided until it is tapped or held.
+ */
+void act_on_event(void)
+{
+    keymatrix::KeyEvent evt = pending_events[0];
+    num_pending_events--;
+    for (unsigned i = 0; i < num_pending_events; ++i) {
+        pending_events[i] = pending_events[i + 1];
+    }
+
+    keymatrix::Key key;
+    if (evt.pressed) {
+        key = lookup_key(evt.key);
+        if (is_tap_hold_key(key)) {
+            tap_hold = { true, evt.key, key, evt.time_us };
+            return;
+        }
+        pressed_codes[evt.key] = key;
+    } else {
+        key = pressed_codes[evt.key];
+        pressed_codes[evt.key] = KEY(NOEVT);
+    }
+
+    apply_key(evt, key);
+}
+
+/**
+ * @brief Goes through the pending key events, until each is acted on or held back
+ */
+void run_pending_events(void)
+{
+    while (num_held_events < num_pending_events) {
+        if (tap_hold.undecided) {
+            hold_back_event();
+        } else {
+            act_on_event();
+        }
+    }
+}
+
+/**
+ * @brief Processes a single key event
+ *
+ * Key events are acted on right away, unless a tap-hold key is undecided. Then they are held back
+ * (in order) until it is decided, and replayed after. If too many are held back, it is held.
+ *
+ * @param[in] evt  key event
+ */
+void handle_key_event(const keymatrix::KeyEvent &evt)
+{
+    while (num_pending_events == TAP_HOLD_EVENTS) {
+        decide_tap_hold(true);
+        run_pending_events();
+    }
+
+    pending_events[num_pending_events++] = evt;
+    run_pending_events();
+}
+
+/**
+ * @brief Decides the tap-hold key as held, once it has been held for `TAP_HOLD_US`
+ *
+ * @param[in] time_us  time of the scan, in microseconds (see `timer::now_us()`)
+ *
+ * @return true if a tap-hold key is still undecided
+ */
+bool check_tap_hold(uint32_t time_us)
+{
+    if (tap_hold.undecided && ((time_us - tap_hold.time_us) >= TAP_HOLD_US)) {
+        decide_tap_hold(true);
+        run_pending_events();
+    }
+
+    return tap_hold.undecided;
+}
+
+/**
+ * @brief Checks the held back combo key presses against the combos
+ *
+ * @param[out] exact  combo whose keys are exactly the ones held back, or NUM_COMBOS if none
+ *
+ * @return true if more keys could still make a combo (a combo has more keys than held back)
+ */
+bool match_combos(unsigned &exact)
+{
+    bool partial = false;
+    exact        = NUM_COMBOS;
+
+    for (unsigned ncombo = 0; ncombo < NUM_COMBOS; ++ncombo) {
+        const uint32_t *keys = combo_table.keys[ncombo];
+        bool subset = true;
+        bool equal  = true;
+        for (unsigned i = 0; i < KEY_WORDS; ++i) {
+            subset = subset && ((keys[i] & combo_pressed[i]) == combo_pressed[i]);
+            equal  = equal && (keys[i] == combo_pressed[i]);
+        }
+
+        if (equal) {
+            exact = ncombo;
+        } else if (subset) {
+            partial = true;
+        }
+    }
+
+    return partial;
+}
+
+/**
+ * @brief Ends the held back combo key presses, as a combo or as the keys themselves
+ *
+ * If they are a combo, the combo's virtual key is pressed (as of the last press), and the combo's
+ * key releases are swallowed. Else, the presses are passed on, in order.
+ *
+ * @param[in] ncombo  combo the presses are, or NUM_COMBOS if none
+ */
+void end_combo(unsigned ncombo)
+{
+    unsigned num_events = num_combo_events;
+    num_combo_events    = 0;
+    for (unsigned i = 0; i < KEY_WORDS; ++i) {
+        combo_pressed[i] = 0;
+    }
+
+    if (ncombo < NUM_COMBOS) {
+        combos_on |= 1u << ncombo;
+        for (unsigned i = 0; i < KEY_WORDS; ++i) {
+            combo_swallowed[i] |= combo_table.keys[ncombo][i];
+        }
+
+        uint32_t time_us = combo_events[num_events - 1].time_us;
+        handle_key_event({ static_cast<uint8_t>(keymatrix::NUM_KEYS + ncombo), true, time_us });
+        return;
+    }
+
+    for (unsigned i = 0; i < num_events; ++i) {
+        handle_key_event(combo_events[i]);
+    }
+}
+
+/**
+ * @brief Passes on a key event, first checking it for combos
+ *
+ * Presses of keys in a combo are held back while they could still make one. Once the keys held back
+ * are exactly a combo (and no other combo has more keys), it is pressed. Any other key event, or
+ * `COMBO_MS` passing, ends the combo early (see `check_combo()`). A pressed combo is released with
+ * the first of its keys, and the others' releases are swallowed.
+ *
+ * The combos are matched with a bitmap AND/compare of the keys, a few words for each combo.
+ *
+ * @param[in] evt  key event
+ */
+void handle_combo_event(const keymatrix::KeyEvent &evt)
+{
+    uint32_t bit  = 1u << (evt.key%32);
+    unsigned word = evt.key/32;
+
+    if (evt.pressed && ((combo_table.any[word] & bit) != 0)) {
+        if (num_combo_events == COMBO_KEYS_MAX) {
+            end_combo(NUM_COMBOS);
+        }
+
+        combo_events[num_combo_events++] = evt;
+        combo_pressed[word] |= bit;
+
+        unsigned exact;
+        bool partial = match_combos(exact);
+        if ((exact < NUM_COMBOS) && !partial) {
+            end_combo(exact);
+        } else if ((exact == NUM_COMBOS) && !partial) {
+            end_combo(NUM_COMBOS);
+        }
+        return;
+    }
+
+    if (num_combo_events != 0) {
+        end_combo(NUM_COMBOS);
+    }
+
+    if (!evt.pressed && ((combo_swallowed[word] & bit) != 0)) {
+        combo_swallowed[word] &= ~bit;
+        for (unsigned ncombo = 0; ncombo < NUM_COMBOS; ++ncombo) {
+            if (((combos_on >> ncombo) & 1u) && ((combo_table.keys[ncombo][word] & bit) != 0)) {
+                combos_on &= ~(1u << ncombo);
+                handle_key_event({ static_cast<uint8_t>(keymatrix::NUM_KEYS + ncombo), false,
+                        evt.time_us });
+            }
+        }
+        return;
+    }
+
+    handle_key_event(evt);
+}
+
+/**
+ * @brief Ends the held back combo key presses once `COMBO_MS` has passed since the first
+ *
+ * @param[in] time_us  time of the scan, in microseconds (see `timer::now_us()`)
+ *
+ * @return true if combo key presses are still held back
+ */
+bool check_combo(uint32_t time_us)
+{
+    if ((num_combo_events != 0) && ((time_us - combo_events[0].time_us) >= COMBO_US)) {
+        unsigned exact;
+        match_combos(exact);
+        end_combo(exact);
+    }
+
+    return num_combo_events != 0;
+}
+
+/**
+ * @brief Finds the keys that changed since the last scan, and processes them as key events
+ *
+ * Only columns whose bitmap changed are looked at, and only the rows that changed in them.
+ *
+ * @param[in] cols     debounced pressed rows of each column
+ * @param[in] time_us  time of the scan, in microseconds (see `timer::now_us()`)
+ *
+ * @return true if any key changed
+ */
+bool diff_scan(const uint32_t cols[NUM_COLS], uint32_t time_us)
+{
+    bool any_changed = false;
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        uint32_t changed = cols[ncol] ^ matrix_state[ncol];
+        if (changed == 0) {
+            continue;
+        }
+        matrix_state[ncol] = cols[ncol];
+        any_changed = true;
+
+        for (unsigned nrow = 0; changed != 0; ++nrow, changed >>= 1) {
+            if ((changed & 1u) != 0) {
+                keymatrix::KeyEvent evt;
+                evt.key     = static_cast<uint8_t>(nrow*NUM_COLS + ncol);
+                evt.pressed = ((cols[ncol] >> nrow) & 1u) != 0;
+                evt.time_us = time_us;
+                handle_combo_event(evt);
+            }
+        }
+    }
+
+    return any_changed;
+}
+
+/**
+ * @brief Sets the scan period, from how long the matrix hasn't changed
+ *
+ * The slowest rate whose `after_ms` has passed is used. The period is only changed with the
+ * scheduler when the rate changes.
+ *
+ * @param[in] quiet_ms  time since the matrix last changed, in milliseconds
+ */
+void set_scan_rate(uint32_t quiet_ms)
+{
+    unsigned rate = 0;
+    while (((rate + 1) < COUNT_OF(SCAN_RATES)) && (quiet_ms >= SCAN_RATES[rate + 1].after_ms)) {
+        rate++;
+    }
+
+    if (rate != scan_rate) {
+        scan_rate = rate;
+        timeslice::set_period(keymatrix::task, SCAN_RATES[rate].period_ms);
+
+        // TIM3 takes the new period at its next update, as the task takes it at its next release
+        if (bsp::DMA_SCAN && sweeping) {
+            TIM3->ARR = (SCAN_RATES[rate].period_ms*SWEEP_TIMER_HZ)/1000 - 1;
+        }
+    }
+}
+
+/**
+ * @brief Stops scanning, and waits on a key press to interrupt
+ *
+ * Every column is driven low, so pressing any key pulls its row low, and each row's EXTI line is
+ * armed for the falling edge. A key pressed before the lines were armed gives no edge, so the rows
+ * are read once armed, and if any is already low, scanning carries on instead.
+ *
+ * @return true if armed, false if a key is already pressed
+ */
+bool wait_for_press(void)
+{
+    if (bsp::DMA_SCAN) {
+        stop_sweeps();
+    }
+
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        gpio::regs(scan_plan.cols[ncol].port)->BSRR = scan_plan.cols[ncol].drive_bsrr;
+    }
+
+    wait_settle();
+
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        gpio::enable_exti(bsp::ROWS[nrow]);
+    }
+
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        if (gpio::read_input(bsp::ROWS[nrow]) == gpio::CLR) {
+            for (unsigned i = 0; i < NUM_ROWS; ++i) {
+                gpio::disable_exti(bsp::ROWS[i]);
+            }
+            return false;
+        }
+    }
+
+    waiting = true;
+    return true;
+}
+
+/**
+ * @brief Stops waiting for a key press, masking the row EXTI lines again
+ *
+ * Called by the task once it runs after waiting (scanning would otherwise keep triggering them).
+ */
+void end_wait_for_press(void)
+{
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        gpio::disable_exti(bsp::ROWS[nrow]);
+    }
+    waiting = false;
+}
+
+/**
+ * @brief Handles an edge on any row while waiting for a key press
+ *
+ * The edges are cleared, and the task is resumed straight from here (through PendSV), so the first
+ * press is scanned as soon as this returns. The EXTI lines are left armed until the task has run,
+ * so if the task is held off (e.g. locked out), further edges still resume it.
+ */
+void row_edge_handler(void)
+{
+    for (unsigned nrow = 0; nrow < NUM_ROWS; ++nrow) {
+        gpio::clear_exti(bsp::ROWS[nrow]);
+    }
+
+    timeslice::resume_from_isr(keymatrix::task);
+}
+
+}  // namespace
+
+/// EXTI IRQ handlers need C linkage
+extern "C" void EXTI0_1_IRQHandler(void);
+extern "C" void EXTI2_3_IRQHandler(void);
+extern "C" void EXTI4_15_IRQHandler(void);
+
+/**
+ * @brief Initializes columns/rows
+ *
+ * Takes the given row/columns gpio definitions and inits them as needed.
+ * The inputs need a pullup or else they will float.
+ */
+void keymatrix::init(void)
+{
+    // init each col gpio as open drain output
+    for (unsigned i = 0; i < NUM_COLS; ++i) {
+        gpio::enable_port_clock(bsp::COLS[i]);
+        gpio::set_mode(bsp::COLS[i], gpio::OUTPUT);
+        gpio::set_output_type(bsp::COLS[i], gpio::OPEN_DRAIN);
+    }
+
+    // init each row gpio as pullup input, with its EXTI line ready (but masked) for waiting
+    for (unsigned i = 0; i < NUM_ROWS; ++i) {
+        gpio::enable_port_clock(bsp::ROWS[i]);
+        gpio::set_mode(bsp::ROWS[i], gpio::INPUT);
+        gpio::set_pull(bsp::ROWS[i], gpio::PULL_UP);
+        gpio::set_exti(bsp::ROWS[i], gpio::FALLING_EDGE);
+        gpio::disable_exti(bsp::ROWS[i]);
+        NVIC_EnableIRQ(gpio::exti_irq(bsp::ROWS[i]));
+    }
+
+    load_keymap();
+
+    calibrate_settle();
+    print_settle();
+    if (bsp::DMA_SCAN) {
+        init_dma_scan();
+    }
+
+    auto status = timeslice::register_task(KEY_MATRIX_TASK_PERIOD_MS, keymatrix::task);
+    DBG_ASSERT(status == timeslice::SUCCESS);
+
+    debug::puts("Initialized: Key Matrix\r\n");
+}
+
+/**
+ * @brief Scans the keys, and processes the ones that changed
+ *
+ * This task will scan the physical keys each task period (or take the last DMA sweep), block
+ * possible ghosts, debounce the scan, and diff it against the last. The key state holds the
+ * keycodes of every key pressed, each looked up in the layers that were on when it was pressed.
+ * The callbacks of callback keys are called when they are pressed.
+ *
+ * The scan period steps down through `SCAN_RATES` while the matrix isn't changing, and goes back to
+ * the fastest as soon as a scan sees a key changing. After `QUIET_MS_WAIT` without a key pressed,
+ * the task suspends itself until a key press interrupts.
+ *
+ * If the key state changed, the (suspended) USB KB HID task is resumed to report it right away.
+ */
+void keymatrix::task(void)
+{
+    uint32_t raw[NUM_COLS];
+    uint32_t time_us = timer::now_us();
+    uint32_t now_ms  = timeslice::get_ms();
+
+    if (waiting) {
+        end_wait_for_press();
+    }
+
+    if (bsp::DMA_SCAN) {
+        // after waking (or calibrating), sweep right away rather than at the next trigger
+        if (!sweeping) {
+            start_sweeps(SCAN_RATES[scan_rate].period_ms);
+            wait_sweep();
+        }
+        if (!read_sweep(raw)) {
+            return;
+        }
+    } else {
+        scan_matrix(raw);
+    }
+
+    if (!bsp::KEY_DIODES) {
+        block_ghosts(raw, debounced);
+    }
+    debouncer.update(raw, debounced);
+    bool active = diff_scan(debounced, time_us);
+
+    // held back combo keys or an undecided tap-hold key keep the scan rate up, so they end on time
+    active = check_combo(time_us) || active;
+    active = check_tap_hold(time_us) || active;
+
+    // the HID task waits (suspended) for changes, so they are reported in this millisecond
+    if (keymatrix::has_code_events()) {
+        timeslice::resume(kb_hid::task);
+    }
+
+    // a key that is still releasing counts as pressed, and one still debouncing as active
+    uint32_t any_pressed = 0;
+    for (unsigned ncol = 0; ncol < NUM_COLS; ++ncol) {
+        any_pressed |= raw[ncol] | debounced[ncol];
+        active = active || (raw[ncol] != debounced[ncol]);
+    }
+
+    if (active) {
+        last_active_ms = now_ms;
+    }
+    set_scan_rate(now_ms - last_active_ms);
+
+    // if there hasn't been any keypresses for a while, stop scanning until there is. the wake up
+    // scan is at the fastest rate, as it is for a key press
+    if (any_pressed == 0) {
+        if (((now_ms - last_press_ms) >= QUIET_MS_WAIT) && wait_for_press()) {
+            last_active_ms = now_ms;
+            set_scan_rate(0);
+            timeslice::suspend();
+        }
+    } else {
+        last_press_ms = now_ms;
+        idle          = false;
+    }
+}
+
+/**
+ * @brief Gets the next change to the key state
+ *
+ * Changes are in the order they were scanned. Only the HID layer may call this (it is the only
+ * consumer of the queue).
+ *
+ * @param[out] evt  filled with the change
+ *
+ * @return true if there was a change, false if the queue is empty
+ */
+bool keymatrix::pop_code_event(keymatrix::CodeEvent &evt)
+{
+    return code_events.pop(evt);
+}
+
+/**
+ * @brief Checks if there are changes to the key state waiting
+ *
+ * @return true if the queue is not empty
+ */
+bool keymatrix::has_code_events(void)
+{
+    return !code_events.is_empty();
+}
+
+/**
+ * @brief Gets the number of dropped key state changes
+ *
+ * @return number of code events dropped because the queue was full
+ */
+uint32_t keymatrix::get_code_overflows(void)
+{
+    return code_overflows;
+}
+
+/**
+ * @brief Copies the current key state, and drops every queued change
+ *
+ * For catching up after changes were dropped. The key matrix task is HIGH priority, so this is done
+ * under lock: the copy includes every change that was queued, and none from the next scan. Only the
+ * HID layer may call this (it is the only consumer of the queue).
+ *
+ * @param[out] state  filled with the current key state
+ */
+void keymatrix::copy_key_state(keymatrix::KeyState &state)
+{
+    keymatrix::CodeEvent evt;
+
+    timeslice::lock();
+    state = key_state;
+    while (code_events.pop(evt)) {}
+    timeslice::unlock();
+}
+
+/**
+ * @brief Calibrates the row settle time again
+ *
+ * The settle time is calibrated at init, but can be done again on demand (e.g. if the temperature
+ * has changed a lot, see `REQ_CALIBRATE`). The task is locked out while calibrating (well under a
+ * millisecond), so it never lands in the middle of a scan, and DMA sweeps are stopped until the
+ * task's next call. The results are then printed. Only called from the loop, since printing blocks.
+ *
+ * If the task is waiting on a key press, measuring a row trips its EXTI line, so the task wakes for
+ * a scan and goes back to waiting after `QUIET_MS_WAIT`.
+ */
+void keymatrix::calibrate(void)
+{
+    timeslice::lock();
+    if (bsp::DMA_SCAN && sweeping) {
+        stop_sweeps();
+    }
+    calibrate_settle();
+    if (bsp::DMA_SCAN) {
+        set_sweep_timing();
+    }
+    timeslice::unlock();
+
+    print_settle();
+}
+
+/**
+ * @brief Returns whether the keyboard is idle
+ *
+ * If no key presses have occurred in `IDLE_MS_SLEEP`, the keyboard is considered idle. This is
+ * latched until the next key press, so it doesn't wrap around with the millisecond count. Scanning
+ * may be stopped long before then, so it is timed rather than counted in scans.
+ *
+ * @return if keyboard is idle
+ */
+bool keymatrix::is_idle(void)
+{
+    // the key matrix task is HIGH priority, and could press a key in the middle of this
+    timeslice::lock();
+    if (!idle && ((timeslice::get_ms() - last_press_ms) >= lighting::IDLE_MS_SLEEP)) {
+        idle = true;
+    }
+    bool is_idle = idle;
+    timeslice::unlock();
+
+    return is_idle;
+}
+
+/**
+ * @brief Remaps a key on a layer, saving it to FLASH
+ *
+ * The key takes its new keycode from its next press. It is saved in a remap slot (the one it is
+ * already in, or else a free one), and remapping a key back to the BSP's keycode frees its slot.
+ * Only called from the loop, since it may wait on a FLASH write.
+ *
+ * @param[in] layer  keymap layer
+ * @param[in] key    key index (see `keymatrix::NUM_KEYS`)
+ * @param[in] code   keycode
+ *
+ * @return true if the key was remapped and saved, false if the remap was invalid, there was no
+ *         free remap slot, or the FLASH write failed
+ */
+bool keymatrix::remap_key(unsigned layer, unsigned key, keymatrix::Key code)
+{
+    if (!is_valid_remap(layer, key, code)) {
+        debug::printf("WARNING: invalid remap of key %u layer %u (0x%04x)\r\n", key, layer, code);
+        return false;
+    }
+
+    uint16_t key_word = static_cast<uint16_t>((layer << 8) | key);
+    bool is_default   = (code == default_keymap[layer][key]);
+
+    unsigned slot = find_remap_slot(key_word);
+    if (slot == persist::REMAP_SLOTS) {
+        if (is_default) {
+            set_keymap(layer, key, code);
+            return true;
+        }
+
+        slot = find_remap_slot(REMAP_EMPTY);
+        if (slot == persist::REMAP_SLOTS) {
+            debug::printf("WARNING: no free remap slot for key %u layer %u\r\n", key, layer);
+            return false;
+        }
+    }
+
+    set_keymap(layer, key, code);
+
+    // the keycode is written before the key word, so a slot is never taken with a stale keycode
+    persist::Status pstat;
+    if (is_default) {
+        remap_slots[slot] = REMAP_EMPTY;
+        pstat = persist::write_data(remap_key_id(slot), REMAP_EMPTY);
+    } else {
+        pstat = persist::write_data(remap_code_id(slot), static_cast<uint16_t>(code));
+        if ((pstat == persist::SUCCESS) && (remap_slots[slot] != key_word)) {
+            remap_slots[slot] = key_word;
+            pstat = persist::write_data(remap_key_id(slot), key_word);
+        }
+    }
+
+    return pstat == persist::SUCCESS;
+}
+
+/**
+ * @brief Clears every remapped key, going back to the BSP's keymap
+ *
+ * Only called from the loop, since it may wait on FLASH writes.
+ */
+void keymatrix::reset_keymap(void)
+{
+    for (unsigned slot = 0; slot < persist::REMAP_SLOTS; ++slot) {
+        uint16_t key_word = remap_slots[slot];
+        if (key_word == REMAP_EMPTY) {
+            continue;
+        }
+
+        unsigned layer = key_word >> 8;
+        unsigned key   = key_word & 0xFFu;
+        set_keymap(layer, key, default_keymap[layer][key]);
+
+        remap_slots[slot] = REMAP_EMPTY;
+        persist::write_data(remap_key_id(slot), REMAP_EMPTY);
+    }
+}
+
+/**
+ * @brief USB vendor request event handler
+ *
+ * Takes every vendor request the host has sent, and handles the key matrix ones (see
+ * `keymatrix::KeymapRequest`).
+ */
+void event::handle_USB_VENDOR(const event::Event &)
+{
+    usb::VendorRequest req;
+
+    while (usb::pop_vendor_request(req)) {
+        switch (req.request) {
+        case keymatrix::REQ_REMAP_KEY:
+            keymatrix::remap_key(req.value >> 8, req.value & 0xFFu,
+                    static_cast<keymatrix::Key>(req.index));
+            break;
+        case keymatrix::REQ_RESET_KEYMAP:
+            keymatrix::reset_keymap();
+            break;
+        case keymatrix::REQ_CALIBRATE:
+            keymatrix::calibrate();
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief EXTI lines 0-1 IRQ Handler
+ */
+void EXTI0_1_IRQHandler(void)
+{
+    row_edge_handler();
+}
+
+/**
+ * @brief EXTI lines 2-3 IRQ Handler
+ */
+void EXTI2_3_IRQHandler(void)
+{
+    row_edge_handler();
+}
+
+/**
+ * @brief EXTI lines 4-15 IRQ Handler
+ */
+void EXTI4_15_IRQHandler(void)
 {
-    return (idle_loops >= IDLE_LOOPS_SLEEP);
+    row_edge_handler();
 }
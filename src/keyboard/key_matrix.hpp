@@ -14,14 +14,26 @@
  * Two keypress functionality exist in this module:
  *   1. Constantly pressed key buffering
  *
- *   The key in buffer is filled with every key currently pressed. This is what USB HID wants.
- *   Functionality to get this buffer is TBD.
+ *   The key state holds every keycode currently pressed, as a bitmap (so there is no limit on how
+ *   many keys can be pressed at once). This is what USB HID wants. It is kept up to date from key
+ *   events (found by diffing consecutive scans), so it only changes when a key is pressed or
+ *   released. Every change is also queued (timestamped, in order), so USB HID can send each one to
+ *   the host however quickly they come.
  *
  *   2. Single callback key presses
  *
  *   For specified keys, a callback function will be called ONCE per key press, so the user needs
  *   to release the key and press it again for the callback to be called again. This is useful for
  *   user keys, such as changing the RGB LED color, brightness, etc.
+ *
+ * A key's keycode comes from the BSP's keymap layers (see `LAYER_TABLE`). Layers are switched on by
+ * layer keys (momentary, toggle, or one-shot), and the highest layer that is on and not transparent
+ * for the key wins. The keycode is looked up once, when the key is pressed. Tap-hold keys are one
+ * keycode when tapped and another when held, decided from the key event timestamps.
+ * Combos are a keycode for pressing a set of keys together (see the BSP's `COMBO_TABLE`).
+ *
+ * Keys can be remapped at runtime (e.g. over USB, see `KeymapRequest`). Remapped keys are saved in
+ * FLASH, and merged with the BSP's keymap into a keymap in RAM at init.
  */
 
 #ifndef KEYBOARD_KEY_MATRIX_HPP_
@@ -30,6 +42,7 @@
 #include <cstdint>
 
 #include "bsp/bsp.hpp"
+#include "util/expressions.hpp"
 #include "stm32f0xx.h"  // NOLINT
 
 /**
@@ -40,9 +53,6 @@
  */
 namespace keymatrix {
 
-/// Keys that can be detected at once
-constexpr unsigned KEY_BUF_SIZE = 6;
-
 /// Get the keycode from a symbol
 #define KEY(x) (HID_USAGE_KEYBOARD_##x)
 
@@ -55,14 +65,73 @@ CALLBACK_KEY_TABLE(K)
 /// Keycodes in HID standard are 16-bit values
 typedef int16_t Key;
 
+/// Number of keys in the matrix (one for each column/row)
+constexpr unsigned NUM_KEYS = COUNT_OF(bsp::COLS)*COUNT_OF(bsp::ROWS);
+
+/// Number of keycodes in the key state (every HID keyboard usage, 0x00-0xFF)
+constexpr unsigned NUM_KEYCODES = 256;
+
+/// Every keycode pressed, keycode N is bit N%32 of word N/32
+struct KeyState {
+    uint32_t keycodes[NUM_KEYCODES/32];
+};
+
+/// A key pressed or released, found by diffing consecutive scans
+struct KeyEvent {
+    uint8_t key;       ///< key index, row*(number of columns) + column (same as the key tables)
+    bool pressed;      ///< true if pressed, false if released
+    uint32_t time_us;  ///< time of the scan that saw it, see `timer::now_us()`
+};
+
+/// Macro expand the number of macros in the BSP's `MACRO_TABLE`
+#define MACRO(name, steps) + 1
+constexpr unsigned NUM_MACROS = 0 MACRO_TABLE(MACRO, TAP, DOWN, UP);
+#undef MACRO
+
+/// A change to the key state (a keycode pressed or released), in the order they were scanned. a
+/// macro key (at or above NUM_KEYCODES) is queued when pressed, for the HID layer to play the macro
+struct CodeEvent {
+    Key key;           ///< keycode
+    bool pressed;      ///< true if pressed, false if released
+    uint32_t time_us;  ///< time of the scan that saw it, see `timer::now_us()`
+};
+
+/// Number of key state changes that can be queued for the HID layer. must be a power of 2
+constexpr unsigned CODE_QUEUE_SIZE = 32;
+
+/// Vendor requests (bRequest) of the key matrix configuration channel, sent with no data stage
+enum KeymapRequest : uint8_t {
+    REQ_REMAP_KEY    = 0x01,  ///< remap a key. wValue = layer << 8 | key index, wIndex = keycode
+    REQ_RESET_KEYMAP = 0x02,  ///< clear every remapped key, back to the BSP's keymap
+    REQ_CALIBRATE    = 0x03,  ///< calibrate the row settle time again
+};
+
 /// Init all rows as pullup inputs and columns as open-drain outputs
 void init(void);
 
 /// Run scan routine, fill internal key buffer, and call any key callbacks
 void task(void);
 
-/// Fills input buffer (OF SIZE `KEY_BUF_SIZE`) with current key buffer
-void copy_key_buffer(Key *key_buf);
+/// Gets the next queued change to the key state. false if there are none
+bool pop_code_event(CodeEvent &evt);
+
+/// Checks if there are queued changes to the key state
+bool has_code_events(void);
+
+/// Gets the number of key state changes dropped because the queue was full
+uint32_t get_code_overflows(void);
+
+/// Copies the current key state, dropping every queued change (e.g. to catch up after an overflow)
+void copy_key_state(KeyState &state);
+
+/// Remap a key on a layer, saved to FLASH. only from the loop (it may wait on a FLASH write)
+bool remap_key(unsigned layer, unsigned key, Key code);
+
+/// Clear every remapped key, back to the BSP's keymap. only from the loop
+void reset_keymap(void);
+
+/// Calibrate the row settle time again, and print it (it is also done at init). Only from the loop
+void calibrate(void);
 
 /// Returns whether the keyboard is idle (no keypresses)
 bool is_idle(void);
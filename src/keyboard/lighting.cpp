@@ -7,6 +7,10 @@
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
  * Uses IS31FL3746A driver to control the RGB LEDs with backlight coloring profiles.
+ *
+ * The key callbacks are ran from the HIGH priority key matrix task, so they only update the
+ * lighting settings. The slow writes of the changed settings to FLASH are left to the LOW priority
+ * lighting task.
  */
 
 #include "keyboard/lighting.hpp"
@@ -14,6 +18,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "core/event.hpp"
 #include "core/time_slice.hpp"
 #include "flash/persist.hpp"
 #include "is31fl3746a/is31fl3746a.hpp"
@@ -99,6 +104,64 @@ struct LightingCtrl{
 /// Lighting control structure instantiation
 LightingCtrl lctrl;
 
+/// Persistent data word for each lighting setting
+struct PersistSetting {
+    persist::DataId id;
+    const uint16_t *val;
+};
+
+/// Every lighting setting saved in FLASH
+const PersistSetting persist_settings[] = {
+    { persist::BRIGHT_IDX,  &lctrl.bright_idx },
+    { persist::PROFILE_IDX, &lctrl.prof_idx   },
+    { persist::SPEED_IDX,   &lctrl.speed_idx  },
+    { persist::RED_IDX,     &lctrl.red_idx    },
+    { persist::GREEN_IDX,   &lctrl.green_idx  },
+    { persist::BLUE_IDX,    &lctrl.blue_idx   },
+};
+
+/// The USB host has suspended the bus (e.g. the host is asleep), so the LEDs should be off
+bool host_suspended = false;
+
+/// Bit mask (by persist::DataId) of settings changed by the key callbacks, but not yet saved
+volatile uint32_t dirty_settings = 0;
+
+/**
+ * @brief Marks a setting as changed, to be saved to FLASH by the lighting task
+ *
+ * @param[in] id  persistent data word of the setting
+ */
+inline void mark_dirty(persist::DataId id)
+{
+    dirty_settings |= (1UL << id);
+}
+
+/**
+ * @brief Saves a changed setting to FLASH
+ *
+ * Only one setting is saved per call, since a single FLASH write can take a while (especially if
+ * it causes the EEPROM emulation to transfer pages). Any others are saved on the following calls.
+ *
+ * The dirty mask is shared with the HIGH priority key callbacks, so it is changed under lock. A
+ * setting changed again while being saved is simply marked dirty again, and saved again later.
+ */
+void save_settings(void)
+{
+    for (unsigned i = 0; i < COUNT_OF(persist_settings); ++i) {
+        uint32_t msk = (1UL << persist_settings[i].id);
+
+        timeslice::lock();
+        bool dirty = (dirty_settings & msk) != 0;
+        dirty_settings &= ~msk;
+        timeslice::unlock();
+
+        if (dirty) {
+            persist::write_data(persist_settings[i].id, *persist_settings[i].val);
+            return;
+        }
+    }
+}
+
 /**
  * @brief Converts RGB indicies to RGB code
  *
@@ -260,13 +323,26 @@ void lighting::init(void)
 /**
  * @brief Task for updating RGB LEDs.
  *
- * Runs chosen lighting profile. If the key matrix is idle, or the brightness is at 0, the LED
- * driver will be put into sleep mode, where it will just turn off LEDs.
+ * Runs chosen lighting profile. If the key matrix is idle, the brightness is at 0, or the USB host
+ * has suspended the bus, the LED driver will be put into sleep mode, where it will just turn off
+ * LEDs. Any settings changed by the key callbacks are saved to FLASH.
+ *
+ * Writing the LEDs is split into chunks over several ticks. While a write is partway through, the
+ * task is called back at the next tick just to carry it on, without stepping the profiles.
  */
 void lighting::task(void)
 {
+    if (is31fl3746a::is_busy()) {
+        if (is31fl3746a::update() == timeslice::CO_YIELDED) {
+            timeslice::resume_next_tick();
+        }
+        return;
+    }
+
+    save_settings();
+
     static bool was_idle = false;
-    bool is_idle = keymatrix::is_idle() || (lctrl.bright_idx == 0);
+    bool is_idle = keymatrix::is_idle() || (lctrl.bright_idx == 0) || host_suspended;
 
     // if transitioning into idle, sleep. if transitioning out of idle, wake
     if (!was_idle && is_idle) {
@@ -296,6 +372,10 @@ void lighting::task(void)
     }
 
     was_idle = is_idle;
+
+    if (is31fl3746a::update() == timeslice::CO_YIELDED) {
+        timeslice::resume_next_tick();
+    }
 }
 
 // "WarNing: dOcumEnTed SYMboL 'vOid KEYMAtrix::callBaCk_*' WAs nOt DeCLarED Or DeFINed."
@@ -306,122 +386,154 @@ void lighting::task(void)
 /**
  * @brief BRTUP key callback __WEAK override
  *
- * Brightness setting up. Saturates at max. Updates persistent data value in FLASH.
+ * Brightness setting up. Saturates at max. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_BRTUP(void)
 {
     lctrl.bright_idx = NEXT_LINEAR_INDEX(lctrl.bright_idx, BRIGHTNESS_LEVELS);
-    persist::write_data(persist::BRIGHT_IDX, lctrl.bright_idx);
+    mark_dirty(persist::BRIGHT_IDX);
 }
 
 /**
  * @brief BRTDN key callback __WEAK override
  *
- * Brightness setting down. Saturates at min. Updates persistent data value in FLASH.
+ * Brightness setting down. Saturates at min. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_BRTDN(void)
 {
     lctrl.bright_idx = PREV_LINEAR_INDEX(lctrl.bright_idx, BRIGHTNESS_LEVELS);
-    persist::write_data(persist::BRIGHT_IDX, lctrl.bright_idx);
+    mark_dirty(persist::BRIGHT_IDX);
 }
 
 /**
  * @brief R_UP key callback __WEAK override
  *
- * Red intensity index up. Updates persistent data value in FLASH.
+ * Red intensity index up. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_R_UP(void)
 {
     lctrl.red_idx = NEXT_LINEAR_INDEX(lctrl.red_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::RED_IDX, lctrl.red_idx);
+    mark_dirty(persist::RED_IDX);
 }
 
 /**
  * @brief R_DN key callback __WEAK override
  *
- * Red intensity index down. Updates persistent data value in FLASH.
+ * Red intensity index down. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_R_DN(void)
 {
     lctrl.red_idx = PREV_LINEAR_INDEX(lctrl.red_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::RED_IDX, lctrl.red_idx);
+    mark_dirty(persist::RED_IDX);
 }
 
 /**
  * @brief G_UP key callback __WEAK override
  *
- * Green intensity index up. Updates persistent data value in FLASH.
+ * Green intensity index up. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_G_UP(void)
 {
     lctrl.green_idx = NEXT_LINEAR_INDEX(lctrl.green_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::GREEN_IDX, lctrl.green_idx);
+    mark_dirty(persist::GREEN_IDX);
 }
 
 /**
  * @brief G_DN key callback __WEAK override
  *
- * Green intensity index down. Updates persistent data value in FLASH.
+ * Green intensity index down. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_G_DN(void)
 {
     lctrl.green_idx = PREV_LINEAR_INDEX(lctrl.green_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::GREEN_IDX, lctrl.green_idx);
+    mark_dirty(persist::GREEN_IDX);
 }
 
 /**
  * @brief B_UP key callback __WEAK override
  *
- * Blue intensity index up. Updates persistent data value in FLASH.
+ * Blue intensity index up. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_B_UP(void)
 {
     lctrl.blue_idx = NEXT_LINEAR_INDEX(lctrl.blue_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::BLUE_IDX, lctrl.blue_idx);
+    mark_dirty(persist::BLUE_IDX);
 }
 
 /**
  * @brief B_DN key callback __WEAK override
  *
- * Blue intensity index down. Updates persistent data value in FLASH.
+ * Blue intensity index down. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_B_DN(void)
 {
     lctrl.blue_idx = PREV_LINEAR_INDEX(lctrl.blue_idx, COUNT_OF(RGB_INTENSITIES) - 1);
-    persist::write_data(persist::BLUE_IDX, lctrl.blue_idx);
+    mark_dirty(persist::BLUE_IDX);
 }
 
 /**
  * @brief PROF key callback __WEAK override
  *
- * Cycles through coloring profiles. Updates persistent data value in FLASH.
+ * Cycles through coloring profiles. Marks persistent data value to be updated in FLASH.
  */
 extern void keymatrix::callback_PROF(void)
 {
     lctrl.prof_idx = NEXT_CIRCULAR_INDEX(lctrl.prof_idx, COUNT_OF(PROFILES));
-    persist::write_data(persist::PROFILE_IDX, lctrl.prof_idx);
+    mark_dirty(persist::PROFILE_IDX);
 }
 
 /**
  * @brief SPDUP key callback __WEAK override
  *
- * Speeds up coloring of a given profile (if applicable). Updates persistent data value in FLASH.
+ * Speeds up coloring of a given profile (if applicable). Marks persistent data value to be updated
+ * in FLASH.
  */
 extern void keymatrix::callback_SPDUP(void)
 {
     lctrl.speed_idx = NEXT_LINEAR_INDEX(lctrl.speed_idx, SPEED_LEVELS);
-    persist::write_data(persist::SPEED_IDX, lctrl.speed_idx);
+    mark_dirty(persist::SPEED_IDX);
 }
 
 /**
  * @brief SPDDN key callback __WEAK override
  *
- * Slows down coloring of a given profile (if applicable). Updates persistent data value in FLASH.
+ * Slows down coloring of a given profile (if applicable). Marks persistent data value to be updated
+ * in FLASH.
  */
 extern void keymatrix::callback_SPDDN(void)
 {
     lctrl.speed_idx = PREV_LINEAR_INDEX(lctrl.speed_idx, SPEED_LEVELS);
-    persist::write_data(persist::SPEED_IDX, lctrl.speed_idx);
+    mark_dirty(persist::SPEED_IDX);
+}
+
+/**
+ * @brief USB_SUSPEND event handler __WEAK override
+ *
+ * The host has suspended the bus, so the LEDs are turned off until it resumes.
+ */
+extern void event::handle_USB_SUSPEND(const event::Event &)
+{
+    host_suspended = true;
+}
+
+/**
+ * @brief USB_RESUME event handler __WEAK override
+ *
+ * The host has resumed the bus, so the LEDs can be turned back on.
+ */
+extern void event::handle_USB_RESUME(const event::Event &)
+{
+    host_suspended = false;
+}
+
+/**
+ * @brief USB_RESET event handler __WEAK override
+ *
+ * A bus reset also ends a suspend.
+ */
+extern void event::handle_USB_RESET(const event::Event &)
+{
+    host_suspended = false;
 }
 
 //! @endcond
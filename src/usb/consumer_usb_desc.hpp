@@ -30,6 +30,9 @@ constexpr uint16_t MANUFACT_ID  = 0x0301;
 constexpr uint16_t PRODUCT_ID   = 0x0302;
 constexpr uint16_t HIDREPORT_ID = 0x2200;
 
+/// Number of endpoints the configuration uses (ep0, and EP1 of the consumer interface)
+constexpr unsigned NUM_EP = 2;
+
 /// Descriptor information struct
 struct USBDesc {
     const uint8_t *buf_ptr;
@@ -6,7 +6,14 @@
  * @date      2020/11/02
  * @copyright (c) 2020 Anthony Needles. GNU GPL v3 (see LICENSE)
  *
- * This module will use the USB driver to send HID keycodes to the USB host.
+ * This module will use the USB driver to send HID keycodes to the USB host. The keyboard has two
+ * interfaces. With the report protocol (the default) every pressed key is sent as a bit in a bitmap
+ * (N-key rollover), on interface 1 (EP2). With the boot protocol (e.g. a BIOS) the standard 8 byte
+ * boot report is sent instead, with up to 6 keys, on the boot interface 0 (EP1).
+ *
+ * Macro keys play a macro from the BSP's `MACRO_TABLE` (in flash): a sequence of keycodes pressed
+ * and released, sent as one report per step. Reports are sent as fast as the host takes them (once
+ * per 1ms poll), since the task is resumed as soon as the last report was taken.
  */
 
 #include "usb/kb_hid.hpp"
@@ -21,145 +28,364 @@
 #include "util/debug.hpp"
 #include "stm32f0xx.h" // NOLINT
 
-/// we need to ensure that our key buffer size is equal to what we describe in the report descriptor
-static_assert(keymatrix::KEY_BUF_SIZE == 6, "USB HID: Key buffer size must be == 6");
-
 namespace {
 
-/// Task fuction will execute every 20ms
+/// Task fuction will execute every 20ms, unless suspended (it is resumed when there is work to do)
 constexpr unsigned USB_HID_TASK_PERIOD_MS = 20;
 
-/// USB HID transactions occur on EP1, which is configure as an Interrupt EP
-constexpr unsigned INTERRUPT_EPN = 1;
-
-// Bits in modifier byte in HID report
-constexpr uint8_t MODIFIER_LCTRL_MSK  = 0x01;
-constexpr uint8_t MODIFIER_LSHIFT_MSK = 0x02;
-constexpr uint8_t MODIFIER_LALT_MSK   = 0x04;
-constexpr uint8_t MODIFIER_LGUI_MSK   = 0x08;
-constexpr uint8_t MODIFIER_RCTRL_MSK  = 0x10;
-constexpr uint8_t MODIFIER_RSHIFT_MSK = 0x20;
-constexpr uint8_t MODIFIER_RALT_MSK   = 0x40;
-constexpr uint8_t MODIFIER_RGUI_MSK   = 0x80;
-
-/// Both previous key buffer and current key buffer so we can detect a change
-struct KeyBuf {
-    keymatrix::Key curr[keymatrix::KEY_BUF_SIZE];
-    keymatrix::Key prev[keymatrix::KEY_BUF_SIZE];
-};
+/// Boot reports are sent on EP1 (interface 0), which is configured as an Interrupt EP
+constexpr unsigned BOOT_EPN = 1;
+
+/// N-key rollover reports are sent on EP2 (interface 1), which is configured as an Interrupt EP
+constexpr unsigned NKRO_EPN = 2;
 
-/// HID report structure defined by HID Report Descriptor
-struct HIDKBReport{
+/// Keycodes 0x00-0xDF have a bit in the N-key rollover report, 0xE0-0xE7 are the modifier byte
+constexpr unsigned NKRO_KEYCODES = 0xE0;
+
+/// Keycodes that can be sent at once in the boot report
+constexpr unsigned BOOT_KEYS = 6;
+
+/// Report protocol (N-key rollover) report structure, defined by the HID Report Descriptor
+struct NKROReport {
+    uint8_t modifiers;
+    uint8_t keys[NKRO_KEYCODES/8];
+} __PACKED;
+
+/// Boot protocol report structure, fixed by the HID spec (descriptor is ignored by the host)
+struct BootReport {
     uint8_t modifiers;
     uint8_t reserved;
-    uint8_t key0;
-    uint8_t key1;
-    uint8_t key2;
-    uint8_t key3;
-    uint8_t key4;
-    uint8_t key5;
+    uint8_t keys[BOOT_KEYS];
 } __PACKED;
 
-/// Where we hold hold current and previous key buffer copies
-KeyBuf key_buf;
+/// Macro step actions, in the high byte of each step (the keycode is the low byte)
+enum MacroAction : uint16_t {
+    MACRO_TAP  = 0x0000,  ///< press, then release the keycode (two reports)
+    MACRO_DOWN = 0x0100,  ///< press the keycode
+    MACRO_UP   = 0x0200,  ///< release the keycode
+};
 
-}  // namespace
+/// Macro expand the steps of every macro, one macro after another, then a sentinel (never played)
+constexpr uint16_t macro_steps[] = {
+#define TAP(symbol)  (MACRO_TAP | KEY(symbol)),
+#define DOWN(symbol) (MACRO_DOWN | KEY(symbol)),
+#define UP(symbol)   (MACRO_UP | KEY(symbol)),
+#define MACRO(name, steps) steps
+    MACRO_TABLE(MACRO, TAP, DOWN, UP)
+#undef MACRO
+#undef UP
+#undef DOWN
+#undef TAP
+    (MACRO_UP | KEY(NOEVT)),
+};
+
+/// Macro expand the number of steps in each macro, then the sentinel's, so a BSP can have no macros
+constexpr uint16_t macro_lengths[] = {
+#define STEP(symbol) + 1
+#define MACRO(name, steps) (0 steps),
+    MACRO_TABLE(MACRO, STEP, STEP, STEP)
+#undef MACRO
+#undef STEP
+    0,
+};
+
+static_assert(COUNT_OF(macro_lengths) == keymatrix::NUM_MACROS + 1, "A length for each macro");
+
+/// Macro being played
+struct Sequencer {
+    bool playing;
+    unsigned step;              ///< index into `macro_steps` of the next step
+    unsigned end;               ///< index into `macro_steps` just past the macro's last step
+    bool tap_down;              ///< set once a tap step's keycode has been pressed
+    keymatrix::KeyState keys;   ///< keycodes the macro has pressed
+};
+
+/// Key state as sent to the host, kept up to date from the key matrix's queued changes
+keymatrix::KeyState key_state;
+
+/// Macro sequencer, its pressed keycodes are sent along with the key state
+Sequencer sequencer = { };
+
+/// Protocol the last report was sent with
+usb::Protocol last_protocol = usb::REPORT_PROTOCOL;
+
+/// Key matrix overflow count as of the last catch up
+uint32_t seen_overflows = 0;
 
 /**
- * @brief Populate HID report and send it off
+ * @brief Gets the endpoint the reports of a protocol are sent on
  *
- * The report buffer has been defined in the report descriptor that was requested from the device
- * by the host (handled in the usb driver).
+ * @param[in] protocol  HID protocol
  *
- * Technically we don't need to include the key codes for modifier keys (e.g. LCTRL = 0xE0) since
- * drivers just ignore them, but we do anyways because it would involve more logic and we wouldn't
- * gain anything from excluding them.
+ * @return endpoint number
  */
-static void send_report(void)
+unsigned report_epn(usb::Protocol protocol)
 {
-    HIDKBReport report;
+    return (protocol == usb::BOOT_PROTOCOL) ? BOOT_EPN : NKRO_EPN;
+}
 
-    report.modifiers = 0x00;
-    for (unsigned i = 0; i < keymatrix::KEY_BUF_SIZE; ++i) {
-        switch (key_buf.curr[i]) {
-        case KEY(LCTRL):
-            report.modifiers |= MODIFIER_LCTRL_MSK;
-            break;
-        case KEY(LSHFT):
-            report.modifiers |= MODIFIER_LSHIFT_MSK;
-            break;
-        case KEY(LALT):
-            report.modifiers |= MODIFIER_LALT_MSK;
-            break;
-        case KEY(LGUI):
-            report.modifiers |= MODIFIER_LGUI_MSK;
-            break;
-        case KEY(RCTRL):
-            report.modifiers |= MODIFIER_RCTRL_MSK;
-            break;
-        case KEY(RSHFT):
-            report.modifiers |= MODIFIER_RSHIFT_MSK;
-            break;
-        case KEY(RALT):
-            report.modifiers |= MODIFIER_RALT_MSK;
-            break;
-        case KEY(RGUI):
-            report.modifiers |= MODIFIER_RGUI_MSK;
-            break;
-        default:
+/**
+ * @brief Checks if a keycode is pressed in a key state
+ *
+ * @param[in] state  key state
+ * @param[in] key    keycode
+ *
+ * @return true if pressed
+ */
+bool is_pressed(const keymatrix::KeyState &state, unsigned key)
+{
+    return (state.keycodes[key/32] & (1u << (key%32))) != 0;
+}
+
+/**
+ * @brief Gets the modifier byte of a report
+ *
+ * The modifier keycodes (LCTRL = 0xE0 to RGUI = 0xE7) are in order, so the modifier byte is just
+ * their bits of the key state.
+ *
+ * @param[in] state  key state
+ *
+ * @return modifier byte
+ */
+uint8_t get_modifiers(const keymatrix::KeyState &state)
+{
+    static_assert((KEY(LCTRL) % 32) == 0, "Modifier keycodes must start a key state word");
+    return static_cast<uint8_t>(state.keycodes[KEY(LCTRL)/32]);
+}
+
+/**
+ * @brief Populate a report protocol (N-key rollover) report and send it off
+ *
+ * Every keycode has its own bit, so every pressed key is sent no matter how many there are.
+ *
+ * @param[in] state  key state to send
+ */
+void send_nkro_report(const keymatrix::KeyState &state)
+{
+    alignas(uint16_t) NKROReport report;
+
+    report.modifiers = get_modifiers(state);
+    for (unsigned i = 0; i < sizeof(report.keys); ++i) {
+        report.keys[i] = static_cast<uint8_t>(state.keycodes[i/4] >> (8*(i%4)));
+    }
+    usb::write(NKRO_EPN, reinterpret_cast<uint8_t *>(&report), sizeof(report));
+}
+
+/**
+ * @brief Populate a boot protocol report and send it off
+ *
+ * The boot report only has room for 6 keycodes. If more are pressed, every slot is filled with the
+ * rollover error keycode (as the HID spec asks), rather than sending some of them.
+ *
+ * @param[in] state  key state to send
+ */
+void send_boot_report(const keymatrix::KeyState &state)
+{
+    alignas(uint16_t) BootReport report = { };
+    unsigned nkeys = 0;
+
+    report.modifiers = get_modifiers(state);
+    for (unsigned key = KEY(A); key < NKRO_KEYCODES; ++key) {
+        if (!is_pressed(state, key)) {
+            continue;
+        }
+
+        if (nkeys == BOOT_KEYS) {
+            for (unsigned i = 0; i < BOOT_KEYS; ++i) {
+                report.keys[i] = KEY(ROVER);
+            }
             break;
         }
+        report.keys[nkeys++] = static_cast<uint8_t>(key);
     }
-    report.reserved  = 0x00;
-    report.key0      = key_buf.curr[0];
-    report.key1      = key_buf.curr[1];
-    report.key2      = key_buf.curr[2];
-    report.key3      = key_buf.curr[3];
-    report.key4      = key_buf.curr[4];
-    report.key5      = key_buf.curr[5];
-    usb::write(INTERRUPT_EPN, reinterpret_cast<uint8_t *>(&report), sizeof(report));
+    usb::write(BOOT_EPN, reinterpret_cast<uint8_t *>(&report), sizeof(report));
 }
 
 /**
- * @brief Intialize the USB HID module
+ * @brief Send a report of the key state, in the layout of the protocol in use
  *
- * We only need to ready key buffers and initialize the USB driver.
+ * The keycodes pressed by a playing macro are sent as pressed along with the key state.
  */
-void kb_hid::init(void)
+void send_report(void)
+{
+    keymatrix::KeyState state;
+    for (unsigned i = 0; i < COUNT_OF(state.keycodes); ++i) {
+        state.keycodes[i] = key_state.keycodes[i] | sequencer.keys.keycodes[i];
+    }
+
+    if (last_protocol == usb::BOOT_PROTOCOL) {
+        send_boot_report(state);
+    } else {
+        send_nkro_report(state);
+    }
+}
+
+/**
+ * @brief Starts playing a macro
+ *
+ * @param[in] macro  index of the macro in the BSP's `MACRO_TABLE`
+ */
+void start_macro(unsigned macro)
+{
+    if (macro >= keymatrix::NUM_MACROS) {
+        return;
+    }
+
+    unsigned start = 0;
+    for (unsigned i = 0; i < macro; ++i) {
+        start += macro_lengths[i];
+    }
+
+    sequencer.playing  = true;
+    sequencer.step     = start;
+    sequencer.end      = start + macro_lengths[macro];
+    sequencer.tap_down = false;
+}
+
+/**
+ * @brief Plays the next step of the macro
+ *
+ * Once past the last step, the macro ends, releasing any keycodes it left pressed.
+ *
+ * @return true if the macro's keycodes changed, and need a report
+ */
+bool play_step(void)
 {
-    // clear out the 'previous' key buffer
-    for (unsigned i = 0; i < keymatrix::KEY_BUF_SIZE; ++i) {
-        key_buf.prev[i] = KEY(NOEVT);
+    if (sequencer.step == sequencer.end) {
+        bool any_down = false;
+        for (uint32_t &word : sequencer.keys.keycodes) {
+            any_down = any_down || (word != 0);
+            word     = 0;
+        }
+        sequencer.playing = false;
+        return any_down;
     }
 
+    uint16_t step = macro_steps[sequencer.step];
+    uint32_t &word = sequencer.keys.keycodes[(step & 0xFFu)/32];
+    uint32_t bit   = 1u << ((step & 0xFFu)%32);
+
+    switch (step & 0xFF00u) {
+    case MACRO_TAP:
+        // the keycode is pressed by one report, and released by the next
+        sequencer.tap_down = !sequencer.tap_down;
+        if (sequencer.tap_down) {
+            word |= bit;
+            return true;
+        }
+        word &= ~bit;
+        break;
+    case MACRO_DOWN:
+        word |= bit;
+        break;
+    case MACRO_UP:
+        word &= ~bit;
+        break;
+    default:
+        break;
+    }
+
+    sequencer.step++;
+    return true;
+}
+
+/**
+ * @brief Applies a key state change to the key state copy
+ *
+ * @param[in] evt  key state change
+ */
+void apply_event(const keymatrix::CodeEvent &evt)
+{
+    uint32_t bit = 1u << (evt.key%32);
+
+    if (evt.pressed) {
+        key_state.keycodes[evt.key/32] |= bit;
+    } else {
+        key_state.keycodes[evt.key/32] &= ~bit;
+    }
+}
+
+}  // namespace
+
+/**
+ * @brief Intialize the USB HID module
+ *
+ * Initializes the USB driver, and has it resume the task whenever a report endpoint is ready.
+ */
+void kb_hid::init(void)
+{
     usb::init();
 
     auto status = timeslice::register_task(USB_HID_TASK_PERIOD_MS, kb_hid::task);
     DBG_ASSERT(status == timeslice::SUCCESS);
 
+    usb::set_tx_task(BOOT_EPN, kb_hid::task);
+    usb::set_tx_task(NKRO_EPN, kb_hid::task);
+
     debug::puts("Initialized: USB Keyboard HID\r\n");
 }
 
 /**
- * @brief Periodically sample key buffer, and send report if necessary
+ * @brief Sends every key state change to the host, in order
+ *
+ * The key matrix queues each keycode pressed or released, and each becomes a report of its own, so
+ * a key pressed and released between two task calls still reaches the host. A report can only be
+ * written once the host has taken the last one, so while changes are waiting the task suspends
+ * itself until then, rather than waiting on its period: the USB IRQ handler resumes it as soon as
+ * the host takes it (see `usb::set_tx_task()`). Once there is nothing left to send, it suspends
+ * itself until the key matrix task queues a change and resumes it, so each change is sent in the
+ * millisecond it was scanned.
  *
- * We check the currently pressed keys, and if there has been a change then we send a new key HID
- * report.
+ * A queued macro key plays its macro, one report per step. The changes queued after it wait in the
+ * key matrix's queue until it ends, so they reach the host after the macro. Each step is sent along
+ * with the key state as of the macro key's press (e.g. a held modifier), since the changes after
+ * it aren't applied until the macro ends. If the queue overflows meanwhile, it is caught up on as
+ * below.
+ *
+ * If changes were dropped (the queue overflowed), or the host changed protocol, the queue can't be
+ * replayed, so the whole key state is copied and sent instead.
  */
 void kb_hid::task(void)
 {
-    keymatrix::copy_key_buffer(key_buf.curr);
+    usb::Protocol protocol = usb::get_protocol();
+    uint32_t overflows = keymatrix::get_code_overflows();
 
-    // we only want to send a report when keys states change
-    for (unsigned i = 0; i < keymatrix::KEY_BUF_SIZE; ++i) {
-        if (key_buf.curr[i] != key_buf.prev[i]) {
-            send_report();
-            break;
+    if ((overflows != seen_overflows) || (protocol != last_protocol)) {
+        if (!usb::is_tx_ready(report_epn(protocol))) {
+            timeslice::suspend();
+            return;
         }
+
+        seen_overflows = overflows;
+        last_protocol  = protocol;
+        keymatrix::copy_key_state(key_state);
+        send_report();
     }
 
-    // copy over 'current' keys to 'previous' keys
-    for (unsigned i = 0; i < keymatrix::KEY_BUF_SIZE; ++i) {
-        key_buf.prev[i] = key_buf.curr[i];
+    keymatrix::CodeEvent evt;
+    while (sequencer.playing || keymatrix::has_code_events()) {
+        if (!usb::is_tx_ready(report_epn(last_protocol))) {
+            timeslice::suspend();
+            return;
+        }
+
+        if (sequencer.playing) {
+            if (play_step()) {
+                send_report();
+            }
+            continue;
+        }
+
+        keymatrix::pop_code_event(evt);
+        if (static_cast<unsigned>(evt.key) >= keymatrix::NUM_KEYCODES) {
+            start_macro(static_cast<unsigned>(evt.key) - KEY(MC(0)));
+            continue;
+        }
+
+        apply_event(evt);
+        send_report();
     }
+
+    // nothing left to send, so wait for the key matrix to queue a change
+    timeslice::suspend();
 }
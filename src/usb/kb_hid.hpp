@@ -22,7 +22,7 @@ namespace kb_hid {
 // Inits the USB HID (which includes initializing the base USB driver)
 void init(void);
 
-// Sample the key buffer. If there is a change, send new HID report
+// Send a HID report for each queued key state change (or macro step), in order
 void task(void);
 
 }  // namespace kb_hid
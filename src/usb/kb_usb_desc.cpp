@@ -35,21 +35,23 @@ constexpr uint8_t DESCRIPTOR_DEVICE[] = {
        1,        // bNumConfigurations
 };
 
-// TODO: wakeup? 2 interfaces.
+// TODO: wakeup?
 /// Configuration, Interface, HID, and Endpoint  descriptors. These are eventually asked for, all at
-/// once. These define the device interface as USB HID Keyboard, the report size, and the interrupt
-/// endpoint config.
+/// once. These define the device interfaces as USB HID Keyboards, the report sizes, and the
+/// interrupt endpoint configs. Interface 0 is a boot keyboard (8 byte reports on EP1), which hosts
+/// that only know the boot protocol (e.g. a BIOS) can use. Interface 1 is the N-key rollover
+/// keyboard (29 byte reports on EP2), which every report is sent on with the report protocol.
 constexpr uint8_t DESCRIPTOR_CONFIG[] = {
 // Configuration Descriptor
        9,        // bLength
        2,        // bDescriptorType        Configuration
-      34, 0x00,  // wTotalLength           9 + 9 + 9 + 7
-       1,        // bNumInterfaces
+      59, 0x00,  // wTotalLength           9 + (9 + 9 + 7)*2
+       2,        // bNumInterfaces
        1,        // bConfigurationValue    Set Configuration argument
        0,        // iConfiguration         No string
     0x80,        // bmAttributes           Bus powered, no wake-up
      250,        // bMaxPower              250*2 = 500 mA
-// Interface Descriptor
+// Interface 0 Descriptor
        9,        // bLength
        4,        // bDescriptorType        Interface
        0,        // bInterfaceNumber
@@ -59,7 +61,7 @@ constexpr uint8_t DESCRIPTOR_CONFIG[] = {
     0x01,        // bInterfaceSubClass     Boot
     0x01,        // bInterfaceProtocol     Keyboard
        0,        // iInterface             No string
-// HID Descriptor
+// Interface 0 HID Descriptor
        9,        // bLength
     0x21,        // bDescriptorType        HID
     0x11, 0x01,  // bcdHID                 HID 1.11
@@ -72,8 +74,33 @@ constexpr uint8_t DESCRIPTOR_CONFIG[] = {
        5,        // bDescriptorType        Endpoint
     0x81,        // bEndpointAddress       1, In
     0x03,        // bmAttributes           Interrupt
-       8, 0x00,  // wMaxPacketSize         8 bytes
-      10,        // bInterval              10 ms
+       8, 0x00,  // wMaxPacketSize         8 bytes (boot report)
+       1,        // bInterval              1 ms
+// Interface 1 Descriptor
+       9,        // bLength
+       4,        // bDescriptorType        Interface
+       1,        // bInterfaceNumber
+       0,        // bAlternateSetting
+       1,        // bNumEndpoints
+    0x03,        // bInterfaceClass        HID
+    0x00,        // bInterfaceSubClass     None
+    0x00,        // bInterfaceProtocol     None
+       0,        // iInterface             No string
+// Interface 1 HID Descriptor
+       9,        // bLength
+    0x21,        // bDescriptorType        HID
+    0x11, 0x01,  // bcdHID                 HID 1.11
+    0x00,        // bCountryCode           Not localized
+       1,        // bNumDescriptors
+    0x22,        // bDescriptorType        Report
+      40, 0x00,  // wDescriptorLength      40 bytes
+// Endpoint 2 In Descriptor
+       7,        // bLength
+       5,        // bDescriptorType        Endpoint
+    0x82,        // bEndpointAddress       2, In
+    0x03,        // bmAttributes           Interrupt
+      32, 0x00,  // wMaxPacketSize         32 bytes (29 byte report)
+       1,        // bInterval              1 ms
 };
 
 /// Language String Descriptor (index 0). Our string descs are in English.
@@ -121,7 +148,9 @@ constexpr uint8_t DESCRIPTOR_PRODUCT[] = {
       'd', 0x00,
 };
 
-/// HID Report Descriptor. Defines the format of key packets we send.
+/// Boot keyboard HID Report Descriptor (interface 0). Describes the boot report layout the HID spec
+/// fixes: the modifier byte, a reserved byte, then an array of 6 keycodes. Also has the LED output
+/// report.
 constexpr uint8_t DESCRIPTOR_HIDREPORT[] = {
     0x05, 0x01,  // Usage Page   = Desktop,
     0x09, 0x06,  // Usage        = Keyboard,
@@ -138,7 +167,7 @@ constexpr uint8_t DESCRIPTOR_HIDREPORT[] = {
 // Keyboard Input, Byte 1: Reserved
     0x95, 0x01,  // Report Count = 1,
     0x75, 0x08,  // Report Size  = 8,
-    0x81, 0x01,  // Input        = Cnst, Arr, Abs
+    0x81, 0x01,  // Input        = Cnst
 // LED Output Report
     0x95, 0x05,  // Report Count = 5
     0x75, 0x01,  // Report Size  = 1
@@ -149,19 +178,52 @@ constexpr uint8_t DESCRIPTOR_HIDREPORT[] = {
     0x95, 0x01,  // Report Count = 1
     0x75, 0x03,  // Report Size  = 3
     0x91, 0x01,  // Output       = Cnst
-// Keyboard Input, Bytes 2-7: Pressed Key Keycodes
-    0x95, 0x06,  // Report Count = 6
-    0x75, 0x08,  // Report Size  = 8
-    0x15, 0x00,  // Logical Min  = 0
-    0x26, 0x97,  // Logical Max  = 101
+// Keyboard Input, Bytes 2-7: Pressed Keycode Array
+    0x95, 0x06,  // Report Count = 6,
+    0x75, 0x08,  // Report Size  = 8,
+    0x15, 0x00,  // Logical Min  = 0,
+    0x26, 0xDF,  // Logical Max  = 223 (every keycode the N-key rollover report has),
     0x00,
+    0x05, 0x07,  // Usage Page   = Keyboard,
+    0x19, 0x00,  // Usage Min    = No Event,
+    0x29, 0xDF,  // Usage Max    = Last non-modifier keycode,
+    0x81, 0x00,  // Input        = Data, Array
+    0xC0,        // End Collection
+};
+
+/// N-key rollover HID Report Descriptor (interface 1). Defines the format of key packets we send
+/// with the report protocol. Every key has a bit, rather than the 6 keycode array of the boot
+/// report.
+constexpr uint8_t DESCRIPTOR_NKROREPORT[] = {
+    0x05, 0x01,  // Usage Page   = Desktop,
+    0x09, 0x06,  // Usage        = Keyboard,
+    0xA1, 0x01,  // Collection   = Application,
+    0x05, 0x07,  // Usage Page   = Keyboard,
+// Keyboard Input, Byte 0: Modifier bitmap (Ctrl, Shift, Alt, etc.)
+    0x19, 0xE0,  // Usage Min    = KB LCtrl,
+    0x29, 0xE7,  // Usage Max    = KB RGui,
+    0x15, 0x00,  // Logical Min  = 0,
+    0x25, 0x01,  // Logical Max  = 1,
+    0x75, 0x01,  // Report Size  = 1,
+    0x95, 0x08,  // Report Count = 8,
+    0x81, 0x02,  // Input        = Data, Var, Abs
+// Keyboard Input, Bytes 1-28: Pressed Key Bitmap (bit N of the bitmap is keycode N)
     0x05, 0x07,  // Usage Page   = Keyboard
     0x19, 0x00,  // Usage Min    = No Event,
-    0x29, 0x97,  // Usage Max    = Max Keycode,
-    0x81, 0x00,  // Input        = Data, Arr, Abs
+    0x29, 0xDF,  // Usage Max    = Last non-modifier keycode,
+    0x15, 0x00,  // Logical Min  = 0
+    0x25, 0x01,  // Logical Max  = 1
+    0x75, 0x01,  // Report Size  = 1
+    0x96, 0xE0,  // Report Count = 224
+    0x00,
+    0x81, 0x02,  // Input        = Data, Var, Abs
     0xC0,        // End Collection
 };
 
+static_assert(DESCRIPTOR_CONFIG[25] == sizeof(DESCRIPTOR_HIDREPORT), "Boot report desc length");
+static_assert(DESCRIPTOR_CONFIG[50] == sizeof(DESCRIPTOR_NKROREPORT), "NKRO report desc length");
+static_assert(DESCRIPTOR_CONFIG[2] == sizeof(DESCRIPTOR_CONFIG), "Config desc total length");
+
 /// Descriptor table entry, pairing the desc ID with desc info
 struct USBDescTableEntry{
     uint16_t id;
@@ -170,12 +232,13 @@ struct USBDescTableEntry{
 
 /// Descriptor table, with an entry for each descriptor
 constexpr USBDescTableEntry desc_table[] = {
-    { usb_desc::DEVICE_ID,    { DESCRIPTOR_DEVICE,    sizeof(DESCRIPTOR_DEVICE)    } },
-    { usb_desc::CONFIG_ID,    { DESCRIPTOR_CONFIG,    sizeof(DESCRIPTOR_CONFIG)    } },
-    { usb_desc::LANG_ID,      { DESCRIPTOR_LANG,      sizeof(DESCRIPTOR_LANG)      } },
-    { usb_desc::MANUFACT_ID,  { DESCRIPTOR_MANUFACT,  sizeof(DESCRIPTOR_MANUFACT)  } },
-    { usb_desc::PRODUCT_ID,   { DESCRIPTOR_PRODUCT,   sizeof(DESCRIPTOR_PRODUCT)   } },
-    { usb_desc::HIDREPORT_ID, { DESCRIPTOR_HIDREPORT, sizeof(DESCRIPTOR_HIDREPORT) } },
+    { usb_desc::DEVICE_ID,     { DESCRIPTOR_DEVICE,     sizeof(DESCRIPTOR_DEVICE)     } },
+    { usb_desc::CONFIG_ID,     { DESCRIPTOR_CONFIG,     sizeof(DESCRIPTOR_CONFIG)     } },
+    { usb_desc::LANG_ID,       { DESCRIPTOR_LANG,       sizeof(DESCRIPTOR_LANG)       } },
+    { usb_desc::MANUFACT_ID,   { DESCRIPTOR_MANUFACT,   sizeof(DESCRIPTOR_MANUFACT)   } },
+    { usb_desc::PRODUCT_ID,    { DESCRIPTOR_PRODUCT,    sizeof(DESCRIPTOR_PRODUCT)    } },
+    { usb_desc::HIDREPORT_ID,  { DESCRIPTOR_HIDREPORT,  sizeof(DESCRIPTOR_HIDREPORT)  } },
+    { usb_desc::NKROREPORT_ID, { DESCRIPTOR_NKROREPORT, sizeof(DESCRIPTOR_NKROREPORT) } },
 };
 
 }  // namespace
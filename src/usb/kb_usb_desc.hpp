@@ -30,6 +30,12 @@ constexpr uint16_t MANUFACT_ID  = 0x0301;
 constexpr uint16_t PRODUCT_ID   = 0x0302;
 constexpr uint16_t HIDREPORT_ID = 0x2200;
 
+/// Report descriptor of interface 1 (the N-key rollover keyboard), the interface is the low byte
+constexpr uint16_t NKROREPORT_ID = 0x2201;
+
+/// Number of endpoints the configuration uses (ep0, and EP1/EP2 of the boot and NKRO interfaces)
+constexpr unsigned NUM_EP = 3;
+
 /// Descriptor information struct
 struct USBDesc {
     const uint8_t *buf_ptr;
@@ -11,16 +11,28 @@
  *
  * Endpoint 0 -> Control
  * Endpoint 1 -> Interrupt, TX only
+ * Endpoint 2 -> Interrupt, TX only (only the keyboard's N-key rollover interface, see NUM_EP)
+ *
+ * Once the host takes a write to an IN endpoint (other than ep0), or the endpoint is configured,
+ * the HIGH priority task set for it with `usb::set_tx_task()` is resumed straight from the IRQ
+ * handler, so the next write can go right away.
+ *
+ * Vendor requests to the device (with no data stage) are a configuration channel. They are queued,
+ * and the loop is told with an event::USB_VENDOR, since handling them may take a while (e.g. a
+ * FLASH write).
  */
 
 #include "usb/usb.hpp"
 
 #include <stdbool.h>
 
+#include "core/event.hpp"
+#include "core/ring.hpp"
+#include "core/time_slice.hpp"
+#include "core/timer.hpp"
 #include "usb/usb_definitions.hpp"
 #include "util/bitop.hpp"
 #include "util/debug.hpp"
-#include "util/expressions.hpp"
 #include "stm32f0xx.h"  // NOLINT
 
 // TODO: find better way for this
@@ -41,8 +53,11 @@
 // usb handler needs C linkage
 extern "C" void USB_IRQHandler(void);
 
-// Total number of EPs used
-#define NUM_EP (2)
+// Total number of EPs used, as declared by the BSP's configuration descriptor
+#define NUM_EP (usb_desc::NUM_EP)
+
+// Number of EPs the PMA is laid out for (see `ep_ctrl`), only the first NUM_EP are used
+#define MAX_EP (3)
 
 // Buffer descriptor table offset in PMA
 #define BDT_OFFSET (0x0000U)
@@ -99,7 +114,9 @@ typedef struct {
     const uint16_t rx_max;
 } ep_ctrl_t;
 
-static ep_ctrl_t ep_ctrl[NUM_EP] = {
+static_assert(NUM_EP <= MAX_EP, "The PMA is only laid out for MAX_EP endpoints");
+
+static ep_ctrl_t ep_ctrl[MAX_EP] = {
     {   // Endpoint 0
         USB_EP_CONTROL,    // flags
         0x0080,            // tx_pma_offset
@@ -116,6 +133,14 @@ static ep_ctrl_t ep_ctrl[NUM_EP] = {
         NO_PMA_USE,        // rx_pma_offset
         RX_MAX_0BYTES,     // rx_max
     },
+    {   // Endpoint 2 (not using RX, only used if the configuration has it)
+        USB_EP_INTERRUPT,  // flags
+        0x0200,            // tx_pma_offset
+        64,                // tx_max
+        true,              // tx_done
+        NO_PMA_USE,        // rx_pma_offset
+        RX_MAX_0BYTES,     // rx_max
+    },
 };
 
 // The buffer descriptor table itself, at the given offset
@@ -125,10 +150,20 @@ static volatile buf_desc_table_t *const BDT =
 // TODO: restructure so these aren't needed
 static usb_setup_packet_t last_setup;
 
+// HID protocol set by the host, read by the HID modules to pick their report layout
+static volatile usb::Protocol protocol = usb::REPORT_PROTOCOL;
+
+// Vendor requests received, but not yet handled by the loop
+static Ring<usb::VendorRequest, usb::VENDOR_QUEUE_SIZE> vendor_requests;
+
+// Task resumed when each IN endpoint is ready for its next write (none if null)
+static void (*volatile tx_tasks[MAX_EP])(void) = { };
+
 static void usb_reset(void);
 static void init_ep(uint16_t ep);
 static void ep0_setup(void);
 static void ep0_tx_sent(void);
+static void tx_ready(uint16_t ep);
 
 /**
  * @brief Performs USB port, clock, and peripheral initialization
@@ -152,7 +187,7 @@ void usb::init(void)
     bitop::clr_msk(USB->CNTR, USB_CNTR_PDWN);
 
     // Startup can take a max of 1us
-    LOOP_DELAY(50);
+    timer::delay_us(1);
 
     // Clear peripheral reset
     USB->CNTR = USB_CNTR_FRES;
@@ -178,8 +213,8 @@ void usb::init(void)
 /**
  * @brief Write data from input buffer into PMA, set TX byte count, and set TX STATUS to VALID
  *
- * Due to a bug when writing bytes into the PMA, only halfword accesses work. So `len` will
- * need to always be even (and `buf` an even number of bytes).
+ * Due to a bug when writing bytes into the PMA, only halfword accesses work. If `len` is odd,
+ * the last byte is written as a halfword of its own (without reading past the end of `buf`).
  *
  * Only works because MCU architecture and USB protocol is little endian.
  *
@@ -201,9 +236,12 @@ void usb::write(uint16_t ep, const uint8_t *buf, uint16_t len)
 
     BDT->bd_ep[ep].tx_size = len;
 
+    uint16_t *pma = reinterpret_cast<uint16_t *>(USB_PMAADDR + ep_ctrl[ep].tx_pma_offset);
     for (int i = 0; i < len/2; ++i) {
-        reinterpret_cast<uint16_t *>(USB_PMAADDR + ep_ctrl[ep].tx_pma_offset)[i] =
-            reinterpret_cast<const uint16_t *>(buf)[i];
+        pma[i] = reinterpret_cast<const uint16_t *>(buf)[i];
+    }
+    if ((len & 1u) != 0) {
+        pma[len/2] = buf[len - 1];
     }
 
     SET_TX_STATUS(ep, USB_EP_TX_VALID);
@@ -212,6 +250,45 @@ void usb::write(uint16_t ep, const uint8_t *buf, uint16_t len)
     NVIC_EnableIRQ(USB_IRQn);
 }
 
+/**
+ * @brief Check if an endpoint has sent its last write
+ *
+ * Once written, the TX STATUS is VALID until the host has taken the packet, then it goes back to
+ * NAK. Writing while VALID would replace a packet the host hasn't seen yet.
+ *
+ * @param[in] ep  the endpoint to check
+ *
+ * @return true if a write won't overwrite a packet waiting to be sent
+ */
+bool usb::is_tx_ready(uint16_t ep)
+{
+    if (ep >= NUM_EP) {
+        DBG_ASSERT(debug::FORCE_ASSERT);
+        return false;
+    }
+
+    return (EP_REG(ep) & USB_EPTX_STAT) != USB_EP_TX_VALID;
+}
+
+/**
+ * @brief Set the task to resume whenever an IN endpoint is ready for its next write
+ *
+ * The task is resumed from the USB IRQ handler, so it must be a HIGH priority task (see
+ * `timeslice::resume_from_isr()`). It can then suspend itself while `usb::is_tx_ready()` is false.
+ *
+ * @param[in] ep         the endpoint (other than ep0)
+ * @param[in] task_func  task to resume, or nullptr for none
+ */
+void usb::set_tx_task(uint16_t ep, void (*task_func)(void))
+{
+    if ((ep == 0) || (ep >= NUM_EP)) {
+        DBG_ASSERT(debug::FORCE_ASSERT);
+        return;
+    }
+
+    tx_tasks[ep] = task_func;
+}
+
 /**
  * @brief Read RX byte count sized block from PMA into input buffer and set RX STATUS to VALID
  *
@@ -240,6 +317,35 @@ void usb::read(uint16_t ep, uint8_t *buf)
     NVIC_EnableIRQ(USB_IRQn);
 }
 
+/**
+ * @brief Get the HID protocol the host has picked
+ *
+ * Hosts that only understand the boot report (e.g. a BIOS) pick the boot protocol with a
+ * SET_PROTOCOL request. Otherwise it is the report protocol, which is also the default after a bus
+ * reset.
+ *
+ * @return HID protocol
+ */
+usb::Protocol usb::get_protocol(void)
+{
+    return protocol;
+}
+
+/**
+ * @brief Take the oldest waiting vendor request
+ *
+ * Each vendor request is acknowledged to the host when received, and posts an event::USB_VENDOR
+ * (with bRequest as the data). The module handling the event takes the request here.
+ *
+ * @param[out] req  vendor request, only written if there was one
+ *
+ * @return true if a vendor request was taken, false if none were waiting
+ */
+bool usb::pop_vendor_request(usb::VendorRequest &req)
+{
+    return vendor_requests.pop(req);
+}
+
 /**
  * @brief Initialize an endpoint
  *
@@ -288,6 +394,20 @@ static void ep0_tx_sent(void)
     }
 }
 
+/**
+ * @brief Resume the task waiting on an IN endpoint, now that it is ready for its next write
+ *
+ * @param[in] ep  the endpoint (other than ep0)
+ */
+static void tx_ready(uint16_t ep)
+{
+    void (*task_func)(void) = tx_tasks[ep];
+
+    if (task_func != nullptr) {
+        timeslice::resume_from_isr(task_func);
+    }
+}
+
 /**
  * @brief Handle SETUP packet
  *
@@ -298,6 +418,7 @@ static void ep0_tx_sent(void)
 static void ep0_setup(void)
 {
     int ret = -1;
+    uint16_t desc_id;
     usb_desc::USBDesc  desc;
 
     // get the setup packet contents
@@ -308,7 +429,13 @@ static void ep0_setup(void)
     // handle both device and interface get descriptor
     case REQ(REQ_IN_STD_DEV, REQ_GET_DESC):
     case REQ(REQ_IN_STD_ITF, REQ_GET_DESC):
-        ret = usb_desc::get_desc(last_setup.wValue, &desc);
+        // each interface has its own report descriptor, so its ID has the interface as the index
+        desc_id = last_setup.wValue;
+        if ((last_setup.bmRequestType == REQ_IN_STD_ITF) && ((desc_id >> 8) == DESC_TYP_HID_RPT)) {
+            desc_id |= last_setup.wIndex & 0xFF;
+        }
+
+        ret = usb_desc::get_desc(desc_id, &desc);
         if (ret >= 0) {
             if (last_setup.wLength > desc.size) {
                 // more data is requested than needs to be sent, we will need to handle
@@ -336,16 +463,37 @@ static void ep0_setup(void)
     case REQ(REQ_OUT_CLS_ITF, REQ_SET_RPT):
         break;
 
+    // this is a class-specific request, the protocol is in the low byte of wValue. only interface 0
+    // can be a boot interface, so it is the only one whose protocol is kept
+    case REQ(REQ_OUT_CLS_ITF, REQ_SET_PROT):
+        if (last_setup.wIndex == 0) {
+            protocol = ((last_setup.wValue & 0xFF) == usb::BOOT_PROTOCOL) ? usb::BOOT_PROTOCOL
+                                                                          : usb::REPORT_PROTOCOL;
+        }
+        usb::write(0, 0, 0);
+        break;
+
+    // this is a class-specific request
+    case REQ(REQ_IN_CLS_ITF, REQ_GET_PROT):
+    {
+        const uint8_t prot = protocol;
+        usb::write(0, &prot, sizeof(prot));
+        break;
+    }
+
     // device has been addressed
     case REQ(REQ_OUT_STD_DEV, REQ_SET_ADDR):
         // Send 0 length packet with address 0
         usb::write(0, 0, 0);
         break;
 
-    // our device has now been configured, can use ep1 now
+    // our device has now been configured, can use the other eps now
     case REQ(REQ_OUT_STD_DEV, REQ_SET_CFG):
         usb::write(0, 0, 0);
-        init_ep(1);
+        for (uint16_t ep = 1; ep < NUM_EP; ++ep) {
+            init_ep(ep);
+            tx_ready(ep);
+        }
         break;
 
     // host request status
@@ -361,6 +509,17 @@ static void ep0_setup(void)
         break;
 
     default:
+        // vendor requests are queued for the loop, and stalled if the queue is full
+        if ((last_setup.bmRequestType == REQ_OUT_VDR_DEV) && (last_setup.wLength == 0)) {
+            usb::VendorRequest req = { last_setup.bRequest, last_setup.wValue, last_setup.wIndex };
+            if (vendor_requests.push(req)) {
+                event::post(event::USB_VENDOR, last_setup.bRequest);
+                usb::write(0, 0, 0);
+            } else {
+                SET_RX_STATUS(0, USB_EP_RX_STALL);
+                SET_TX_STATUS(0, USB_EP_TX_STALL);
+            }
+        }
         break;
     }
 }
@@ -381,8 +540,11 @@ static void usb_reset(void)
 
     init_ep(0);
 
-    // enable reset/transfer interrupts
-    USB->CNTR = USB_CNTR_RESETM | USB_CNTR_ERRM | USB_CNTR_RESETM;
+    // the host has to pick the boot protocol again after every reset
+    protocol = usb::REPORT_PROTOCOL;
+
+    // enable reset/transfer/suspend/wakeup interrupts
+    USB->CNTR = USB_CNTR_RESETM | USB_CNTR_ERRM | USB_CNTR_CTRM | USB_CNTR_SUSPM | USB_CNTR_WKUPM;
 
     // enable device with address 0
     USB->DADDR = USB_DADDR_EF;
@@ -392,6 +554,8 @@ static void usb_reset(void)
  * @brief Route USB events
  *
  * Routes module function based on received interrupts. Most are ignored, except RESET and CTR.
+ * Bus state changes (RESET, SUSP, WKUP) are posted as events, so that modules can react to them
+ * from the loop rather than in here.
  */
 void USB_IRQHandler(void)
 {
@@ -408,16 +572,21 @@ void USB_IRQHandler(void)
     }
 
     if (int_reg & USB_ISTR_WKUP) {
+        bitop::clr_msk(USB->CNTR, USB_CNTR_FSUSP);
         USB->ISTR = ~USB_ISTR_WKUP;
+        event::post(event::USB_RESUME);
     }
 
     if (int_reg & USB_ISTR_SUSP) {
+        bitop::set_msk(USB->CNTR, USB_CNTR_FSUSP);
         USB->ISTR = ~USB_ISTR_SUSP;
+        event::post(event::USB_SUSPEND);
     }
 
     if (int_reg & USB_ISTR_RESET) {
         usb_reset();
         USB->ISTR = ~USB_ISTR_RESET;
+        event::post(event::USB_RESET);
     }
 
     if (int_reg & USB_ISTR_SOF) {
@@ -448,6 +617,8 @@ void USB_IRQHandler(void)
 
             if (int_ep == 0) {
                 ep0_tx_sent();
+            } else {
+                tx_ready(int_ep);
             }
         }
     }
@@ -11,6 +11,15 @@
  *
  * Endpoint 0 -> Control
  * Endpoint 1 -> Interrupt, TX only
+ * Endpoint 2 -> Interrupt, TX only (only the keyboard's N-key rollover interface, see NUM_EP)
+ *
+ * Once the host takes a write to an IN endpoint (other than ep0), or the endpoint is configured,
+ * the HIGH priority task set for it with `usb::set_tx_task()` is resumed straight from the IRQ
+ * handler, so the next write can go right away.
+ *
+ * Vendor requests to the device (with no data stage) are a configuration channel. They are queued,
+ * and the loop is told with an event::USB_VENDOR, since handling them may take a while (e.g. a
+ * FLASH write).
  */
 
 #ifndef USB_USB_HPP_
@@ -25,15 +34,43 @@
  */
 namespace usb {
 
+/// HID protocols, picked by the host with SET_PROTOCOL. Report protocol after every bus reset
+enum Protocol : uint8_t {
+    BOOT_PROTOCOL   = 0,  ///< fixed boot report layout (e.g. BIOS), report descriptor is ignored
+    REPORT_PROTOCOL = 1,  ///< report layout as given by the report descriptor
+};
+
+/// Number of vendor requests that can be waiting to be handled
+constexpr unsigned VENDOR_QUEUE_SIZE = 4;
+
+/// A vendor request with no data stage, from the host's configuration channel
+struct VendorRequest {
+    uint8_t request;  ///< bRequest
+    uint16_t value;   ///< wValue
+    uint16_t index;   ///< wIndex
+};
+
 /// Init the USB module and enter USB RESET
 void init(void);
 
 /// Write via USB with a given endpoint
 void write(uint16_t ep, const uint8_t *buf, uint16_t len);
 
+/// Check if an endpoint has sent its last write (so a new one won't overwrite it)
+bool is_tx_ready(uint16_t ep);
+
+/// Set a HIGH priority task to resume whenever an IN endpoint is ready for its next write
+void set_tx_task(uint16_t ep, void (*task_func)(void));
+
 /// Read via USB with a given endpoint
 void read(uint16_t ep, uint8_t *in_buf);
 
+/// Get the HID protocol the host has picked
+Protocol get_protocol(void);
+
+/// Take the oldest waiting vendor request (one is posted as an event::USB_VENDOR when received)
+bool pop_vendor_request(VendorRequest &req);
+
 }  // namespace usb
 
 #endif  // USB_USB_HPP_
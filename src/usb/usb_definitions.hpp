@@ -29,9 +29,11 @@
 // Entire bmRequestType field
 #define REQ_IN_STD_DEV  (REQ_DIR_IN  | REQ_TYP_STD | REQ_RCP_DEV)
 #define REQ_IN_STD_ITF  (REQ_DIR_IN  | REQ_TYP_STD | REQ_RCP_ITF)
+#define REQ_IN_CLS_ITF  (REQ_DIR_IN  | REQ_TYP_CLS | REQ_RCP_ITF)
 #define REQ_OUT_CLS_ITF (REQ_DIR_OUT | REQ_TYP_CLS | REQ_RCP_ITF)
 #define REQ_OUT_STD_DEV (REQ_DIR_OUT | REQ_TYP_STD | REQ_RCP_DEV)
 #define REQ_OUT_STD_EP  (REQ_DIR_OUT | REQ_TYP_STD | REQ_RCP_EP)
+#define REQ_OUT_VDR_DEV (REQ_DIR_OUT | REQ_TYP_VDR | REQ_RCP_DEV)
 
 // SETUP packet bRequest
 #define REQ_GET_STAT (0x00U)
@@ -41,6 +43,11 @@
 #define REQ_SET_CFG  (0x09U)
 #define REQ_SET_IDLE (0x0AU)
 #define REQ_SET_RPT  (0x09U)
+#define REQ_GET_PROT (0x03U)
+#define REQ_SET_PROT (0x0BU)
+
+// GET_DESCRIPTOR wValue[15:8] descriptor type of a HID report descriptor
+#define DESC_TYP_HID_RPT (0x22U)
 
 // Combines SETUP packet bRequest/bmRequestType fields
 #define REQ(type, req) (((uint16_t)(type) << 8) | ((uint16_t)(req) & 0xFF))
@@ -49,7 +56,7 @@
 
 // User-defined (not sent)
 // HID Usage codes are interpreted as 16-bit unsigned integers, but 0x00E8-0xFFFF is "reserved"
-#define HID_USAGE_KEYBOARD_FN    ( -1)  // alt function
+#define HID_USAGE_KEYBOARD_FN    (HID_USAGE_KEYBOARD_MO(1))  // alt function (layer 1 while held)
 #define HID_USAGE_KEYBOARD_BRTUP ( -2)  // brightness up
 #define HID_USAGE_KEYBOARD_BRTDN ( -3)  // brightness down
 #define HID_USAGE_KEYBOARD_PROF  ( -4)  // cycle profiles
@@ -62,6 +69,21 @@
 #define HID_USAGE_KEYBOARD_G_DN  (-11)  // decrement green color
 #define HID_USAGE_KEYBOARD_B_DN  (-12)  // decrement blue color
 
+// Layer keys (not sent). the action is in the high byte, and the layer in the low byte
+#define HID_USAGE_KEYBOARD_MO(layer) (0x0100 | (layer))  // momentary, layer on while held
+#define HID_USAGE_KEYBOARD_TG(layer) (0x0200 | (layer))  // toggle, layer on/off on each press
+#define HID_USAGE_KEYBOARD_OS(layer) (0x0300 | (layer))  // one-shot, layer on for the next press
+#define HID_USAGE_KEYBOARD_TRNS      (0x0400)            // transparent, use the layer below
+
+// Macro keys (not sent). each plays a macro of the BSP's MACRO_TABLE, by its index
+#define HID_USAGE_KEYBOARD_MC(macro) (0x0500 | (macro))
+
+// Tap-hold keys (not sent). tapped it is the tap keycode, held it is the hold modifier or layer
+#define HID_USAGE_KEYBOARD_MT(mod, tap)   /* mod-tap, mod is one of LCTRL-RGUI */ \
+    (0x1000 | ((HID_USAGE_KEYBOARD_##mod & 0x07) << 8) | HID_USAGE_KEYBOARD_##tap)
+#define HID_USAGE_KEYBOARD_LT(layer, tap) /* layer-tap, layer is 0-7 (momentary when held) */ \
+    (0x1800 | ((layer) << 8) | HID_USAGE_KEYBOARD_##tap)
+
 // Errors
 #define HID_USAGE_KEYBOARD_NOEVT (0x00)
 #define HID_USAGE_KEYBOARD_NONE  (HID_USAGE_KEYBOARD_NOEVT)
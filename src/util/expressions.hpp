@@ -65,18 +65,6 @@ constexpr unsigned PREV_CIRCULAR_INDEX(unsigned index, unsigned indicies)
     return index <= 0 ? indicies - 1 : index - 1;
 }
 
-/**
- * @brief Implement busy-wait loop delay
- *
- * Must measure actual delay for "accuracy"
- *
- * @param[in] loops  the current index
- */
-inline void LOOP_DELAY(int loops)
-{
-    for (volatile int loop_cnt = 0; loop_cnt < loops; ++loop_cnt) { }
-}
-
 /**
  * @brief Find number of elements in an array
  *